@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+
+#include <argh.h>
+
+#include "bench.h"
+#include "logging.h"
+#include "metrics.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+BenchState::BenchState( double min_seconds )
+  : min_seconds_{ min_seconds }, batch_{ 1 }, left_{ 1 }, iterations_{ 0 },
+    started_ns_{ MonotonicNanos() }, paused_ns_{ 0 }, seconds_{ 0 },
+    items_{ 1 }
+{
+}
+
+bool BenchState::NextBatch ()
+{
+  uint64_t now = MonotonicNanos();
+  iterations_ += batch_;
+  seconds_ = ( now - started_ns_ - paused_ns_ ) / 1e9;
+  if( seconds_ >= min_seconds_ )
+  {
+    return false;
+  }
+
+  // Aim for the rest of the time in one or two more batches
+  double per_iteration = seconds_ / iterations_;
+  uint64_t wanted = per_iteration > 0 ?
+    uint64_t( ( min_seconds_ - seconds_ ) / per_iteration / 2 ) : batch_ * 10;
+  batch_ = max( batch_ * 2, min( wanted, batch_ * 100 ));
+  left_ = batch_ - 1;
+  return true;
+}
+
+void BenchState::PauseTiming ()
+{
+  paused_ns_ -= MonotonicNanos();
+}
+
+void BenchState::ResumeTiming ()
+{
+  paused_ns_ += MonotonicNanos();
+}
+
+BenchRunner::BenchRunner( const BenchOptions &options ) : options_( options )
+{
+}
+
+void BenchRunner::AddMicro( const string &name, Micro micro )
+{
+  micro_.emplace_back( name, move( micro ));
+}
+
+void BenchRunner::AddMacro( const string &name, Macro macro )
+{
+  macro_.emplace_back( name, move( macro ));
+}
+
+json BenchRunner::RunMicro( const string &name, const Micro &micro )
+{
+  vector<double> ns_per_op;
+  uint64_t items = 1;
+  uint64_t iterations = 0;
+  for( int rep=0; rep < options_.repetitions; ++rep )
+  {
+    BenchState state( options_.min_seconds );
+    micro( state );
+    ns_per_op.push_back( state.Seconds() * 1e9 / state.Iterations() );
+    items = state.Items();
+    iterations += state.Iterations();
+  }
+  sort( ns_per_op.begin(), ns_per_op.end() );
+
+  double median = ns_per_op[ ns_per_op.size() / 2 ];
+  json r;
+  r["name"] = name;
+  r["kind"] = "micro";
+  r["repetitions"] = options_.repetitions;
+  r["iterations"] = iterations;
+  r["ns_per_op"] = median;
+  r["ns_per_op_min"] = ns_per_op.front();
+  r["ns_per_op_max"] = ns_per_op.back();
+  r["items_per_op"] = items;
+  r["items_per_second"] = items * 1e9 / median;
+  return r;
+}
+
+int BenchRunner::Run( FILE *out )
+{
+  int failed = 0;
+  auto emit = [out]( const json &r ) {
+    fprintf( out, "%s\n", r.dump().c_str() );
+    fflush( out );
+  };
+  auto selected = [this]( const string &name ) {
+    return name.find( options_.filter ) != string::npos;
+  };
+
+  for( const auto &micro : micro_ )
+  {
+    if( selected( micro.first ))
+    {
+      emit( RunMicro( micro.first, micro.second ));
+    }
+  }
+
+  for( const auto &macro : macro_ )
+  {
+    if( !selected( macro.first ))
+    {
+      continue;
+    }
+    json r;
+    try
+    {
+      r = macro.second( options_ );
+    }
+    catch( const exception &e )
+    {
+      r["error"] = e.what();
+      ++failed;
+    }
+    r["name"] = macro.first;
+    r["kind"] = "macro";
+    emit( r );
+  }
+  return failed;
+}
+
+// wiight_bench [--filter=<substring>] [--min_time=<seconds>]
+//              [--repetitions=<n>] [--out=<file>] [--wiight=<binary>]
+//              [--work_dir=<dir>] [--http_port=<n>] [--api_port=<n>]
+//
+// Prints one JSON object per benchmark, to stdout or --out.
+int main( int argc, char **argv )
+{
+  argh::parser cmdl( argc, argv );
+
+  BenchOptions options;
+  cmdl( "filter", options.filter ) >> options.filter;
+  cmdl( "min_time", options.min_seconds ) >> options.min_seconds;
+  cmdl( "repetitions", options.repetitions ) >> options.repetitions;
+  cmdl( "wiight", WIIGHT_BINARY ) >> options.wiight;
+  cmdl( "work_dir", options.work_dir ) >> options.work_dir;
+  cmdl( "http_port", options.http_port ) >> options.http_port;
+  cmdl( "api_port", options.api_port ) >> options.api_port;
+
+  // Only the numbers go to stdout
+  setenv( "LOGLEVEL", "error", 0 );
+  LogOptions log_options;
+  log_options.async = false;
+  StartLogging( log_options );
+
+  FILE *out = stdout;
+  string out_path;
+  if( cmdl( "out" ) >> out_path )
+  {
+    out = fopen( out_path.c_str(), "w" );
+    if( !out )
+    {
+      fprintf( stderr, "Cannot open '%s'\n", out_path.c_str() );
+      return 1;
+    }
+  }
+
+  BenchRunner runner( options );
+  RegisterMicroBenchmarks( runner );
+  RegisterMacroBenchmarks( runner );
+  int failed = runner.Run( out );
+
+  if( out != stdout )
+  {
+    fclose( out );
+  }
+  return failed == 0 ? 0 : 1;
+}
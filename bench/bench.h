@@ -0,0 +1,108 @@
+#ifndef  BENCH_H_
+#define  BENCH_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+
+// Keeps the compiler from discarding a value a benchmark computes.
+template <typename T>
+inline void DoNotOptimize( const T &value )
+{
+  asm volatile( "" : : "r,m"( value ) : "memory" );
+}
+
+// Drives one timed loop:
+//
+//   while( state.KeepRunning() ) { ...one operation... }
+//
+// The clock is only read between growing batches of iterations, so even a
+// few nanosecond operation is timed without the clock dominating it.
+class BenchState
+{
+public:
+  explicit BenchState( double min_seconds );
+
+  bool KeepRunning ()
+  {
+    if( left_ > 0 )
+    {
+      --left_;
+      return true;
+    }
+    return NextBatch();
+  }
+
+  // Work items one iteration handles, for items_per_second.
+  void SetItemsPerIteration( uint64_t items ) { items_ = items; }
+
+  // Excludes setup inside the loop from the time.
+  void PauseTiming ();
+  void ResumeTiming ();
+
+  uint64_t Iterations () const { return iterations_; }
+  double Seconds () const { return seconds_; }
+  uint64_t Items () const { return items_; }
+
+private:
+  bool NextBatch ();
+
+  const double min_seconds_;
+  uint64_t batch_;
+  uint64_t left_;
+  uint64_t iterations_;
+  uint64_t started_ns_;
+  uint64_t paused_ns_;
+  double seconds_;
+  uint64_t items_;
+};
+
+// Options shared by every benchmark, from the command line.
+struct BenchOptions
+{
+  std::string filter;            // Only names containing this
+  double min_seconds = 0.5;      // Per repetition of a micro benchmark
+  int repetitions = 3;
+  std::string wiight;            // Binary the macro benchmarks start
+  std::string work_dir = "/tmp"; // Scratch databases and logs
+  uint16_t http_port = 18080;    // Ports the started wiight listens on
+  uint16_t api_port = 18081;
+};
+
+// Collects micro benchmarks, timed loops repeated and summarized, and macro
+// benchmarks, which run once and report whatever they measured.  Every
+// result is printed as one JSON object per line.
+class BenchRunner
+{
+public:
+  using json = nlohmann::json;
+  using Micro = std::function<void( BenchState &state )>;
+  using Macro = std::function<json( const BenchOptions &options )>;
+
+  explicit BenchRunner( const BenchOptions &options );
+
+  const BenchOptions& Options () const { return options_; }
+
+  void AddMicro( const std::string &name, Micro micro );
+  void AddMacro( const std::string &name, Macro macro );
+
+  // Runs every benchmark the filter selects, printing results to out as
+  // they finish.  Returns the number that failed.
+  int Run( FILE *out );
+
+private:
+  json RunMicro( const std::string &name, const Micro &micro );
+
+  const BenchOptions options_;
+  std::vector<std::pair<std::string, Micro>> micro_;
+  std::vector<std::pair<std::string, Macro>> macro_;
+};
+
+void RegisterMicroBenchmarks( BenchRunner &runner );
+void RegisterMacroBenchmarks( BenchRunner &runner );
+
+#endif  // #ifndef  BENCH_H_
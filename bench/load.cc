@@ -0,0 +1,331 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include <argh.h>
+#include <fmt/format.h>
+
+#include "bench.h"
+#include "logging.h"
+#include "metrics.h"
+#include "process.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// What to throw at the process, from the command line.
+struct LoadOptions
+{
+  int boards = 1;
+  double rate = 100;          // Samples a second per board, 0 is flat out
+  int reader_cpu = -1;        // Reader threads for the boards, on this cpu
+  int ws_clients = 0;         // get_status pollers over the websocket API
+  int http_clients = 0;       // Page and asset fetchers
+  int stream_clients = 0;     // Held open /stream?format=binary readers
+  int stream_rate = 10;       // ...at this many samples a second each
+  int interval_ms = 100;      // Between a client's requests, 0 back to back
+  int duration = 10;          // Seconds of load
+};
+
+// Everything the client threads report, shared between them.
+struct LoadCounters
+{
+  atomic<bool> stop{ false };
+  Histogram ws_latency;
+  Histogram http_latency;
+  atomic<uint64_t> ws_failed{ 0 };
+  atomic<uint64_t> http_failed{ 0 };
+  atomic<uint64_t> stream_bytes{ 0 };
+  atomic<uint64_t> stream_failed{ 0 };
+};
+
+static string StatusRequest ()
+{
+  string message = json( { { "request", "get_status" } } ).dump();
+  message.push_back( '\0' );
+  return message;
+}
+
+static void Pause( const LoadOptions &load )
+{
+  if( load.interval_ms > 0 )
+  {
+    this_thread::sleep_for( chrono::milliseconds( load.interval_ms ));
+  }
+}
+
+// Polls get_status like an open wiight.js page would.
+static void WebsocketClient( const BenchOptions &options,
+                             const LoadOptions &load, LoadCounters *counters )
+{
+  unique_ptr<ApiClient> client;
+  try
+  {
+    client.reset( new ApiClient( options.api_port, 5000 ));
+  }
+  catch( const exception &e )
+  {
+    fprintf( stderr, "%s\n", e.what() );
+    ++counters->ws_failed;
+    return;
+  }
+
+  string message = StatusRequest();
+  while( !counters->stop )
+  {
+    string reply;
+    uint64_t sent_ns = MonotonicNanos();
+    if( client->Request( message, &reply ))
+    {
+      counters->ws_latency.Record( MonotonicNanos() - sent_ns );
+    }
+    else
+    {
+      ++counters->ws_failed;
+    }
+    Pause( load );
+  }
+}
+
+// Fetches the page and its script, as a browser opening it does.
+static void HttpClient( const BenchOptions &options, const LoadOptions &load,
+                        LoadCounters *counters )
+{
+  const char *paths[] = { "/", "/wiight.js" };
+  for( size_t idx=0; !counters->stop; ++idx )
+  {
+    string body;
+    uint64_t sent_ns = MonotonicNanos();
+    if( HttpGet( options.http_port, paths[ idx % 2 ], &body ))
+    {
+      counters->http_latency.Record( MonotonicNanos() - sent_ns );
+    }
+    else
+    {
+      ++counters->http_failed;
+    }
+    Pause( load );
+  }
+}
+
+// Holds a live stream open for the whole run, counting what arrives.
+static void StreamClient( const BenchOptions &options, const LoadOptions &load,
+                          LoadCounters *counters )
+{
+  int fd = socket( AF_INET, SOCK_STREAM, 0 );
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons( options.http_port );
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  // Wake up now and then to notice the end of the run
+  timeval timeout = { 0, 200000 };
+  setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ));
+
+  string request = fmt::format( "GET /stream?format=binary&rate={} "
+                                "HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                                load.stream_rate );
+  if( connect( fd, reinterpret_cast<sockaddr*>( &addr ), sizeof( addr )) < 0 ||
+      write( fd, request.data(), request.size() ) != ssize_t( request.size() ))
+  {
+    ++counters->stream_failed;
+    close( fd );
+    return;
+  }
+
+  char buf[65536];
+  while( !counters->stop )
+  {
+    ssize_t n = read( fd, buf, sizeof( buf ));
+    if( n > 0 )
+    {
+      counters->stream_bytes += n;
+    }
+    else if( n == 0 || ( errno != EAGAIN && errno != EINTR ))
+    {
+      ++counters->stream_failed;
+      break;
+    }
+  }
+  close( fd );
+}
+
+// Board counters from get_status, or null without a websocket API.
+static json DeviceStatus( const BenchOptions &options )
+{
+  try
+  {
+    ApiClient client( options.api_port, 5000 );
+    string reply;
+    if( client.Request( StatusRequest(), &reply ))
+    {
+      // Replies are C strings
+      return json::parse( reply.c_str() ).value( "devices", json() );
+    }
+  }
+  catch( const exception &e )
+  {
+    fprintf( stderr, "No status: %s\n", e.what() );
+  }
+  return json();
+}
+
+static json RunLoad( const BenchOptions &options, const LoadOptions &load )
+{
+  vector<string> args = {
+    fmt::format( "--simulate={}", load.boards ),
+    fmt::format( "--sim_rate={}", load.rate ),
+    fmt::format( "--reader_cpu={}", load.reader_cpu ),
+  };
+  WiightProcess wiight( options, args );
+  auto start_metrics = wiight.WaitForMetrics();
+
+  LoadCounters counters;
+  vector<thread> clients;
+  for( int idx=0; idx < load.ws_clients; ++idx )
+  {
+    clients.emplace_back( WebsocketClient, cref( options ), cref( load ),
+                          &counters );
+  }
+  for( int idx=0; idx < load.http_clients; ++idx )
+  {
+    clients.emplace_back( HttpClient, cref( options ), cref( load ),
+                          &counters );
+  }
+  for( int idx=0; idx < load.stream_clients; ++idx )
+  {
+    clients.emplace_back( StreamClient, cref( options ), cref( load ),
+                          &counters );
+  }
+
+  // Sample the server's counters every second for the sustained rate
+  uint64_t start_ns = MonotonicNanos();
+  uint64_t tick_ns = start_ns;
+  auto metrics = start_metrics;
+  vector<double> rates;
+  for( int second=0; second < load.duration; ++second )
+  {
+    this_thread::sleep_for( chrono::seconds( 1 ));
+    auto previous = metrics;
+    metrics = wiight.WaitForMetrics();
+    uint64_t now = MonotonicNanos();
+    rates.push_back( ( metrics["wiight_samples_total"] -
+                       previous["wiight_samples_total"] ) /
+                     ( ( now - tick_ns ) / 1e9 ));
+    tick_ns = now;
+    fprintf( stderr, "%d s: %.0f samples/s\n", second + 1, rates.back() );
+  }
+  double seconds = ( MonotonicNanos() - start_ns ) / 1e9;
+  json devices = DeviceStatus( options );
+
+  counters.stop = true;
+  for( auto &client : clients )
+  {
+    client.join();
+  }
+
+  double samples = metrics["wiight_samples_total"] -
+    start_metrics["wiight_samples_total"];
+  double min_rate = rates.empty() ? 0 : rates[0];
+  for( double rate : rates )
+  {
+    min_rate = min( min_rate, rate );
+  }
+  uint64_t dropped = 0;
+  for( const auto &device : devices )
+  {
+    dropped += device.value( "dropped", uint64_t( 0 ));
+  }
+
+  json r;
+  r["boards"] = load.boards;
+  r["rate_hz"] = load.rate;
+  r["seconds"] = seconds;
+  r["samples"] = {
+    { "total", samples },
+    { "expected_per_second", load.boards * load.rate },
+    { "per_second", samples / seconds },
+    { "min_per_second", min_rate },
+  };
+  r["dropped"] = devices.is_null() ? json() : json( dropped );
+  r["devices"] = devices;
+
+  json websocket = Latencies( counters.ws_latency );
+  r["websocket"] = {
+    { "clients", load.ws_clients },
+    { "requests_per_second", websocket["count"].get<double>() / seconds },
+    { "failed", counters.ws_failed.load() },
+    { "latency", websocket },
+  };
+  json http = Latencies( counters.http_latency );
+  r["http"] = {
+    { "clients", load.http_clients },
+    { "requests_per_second", http["count"].get<double>() / seconds },
+    { "failed", counters.http_failed.load() },
+    { "latency", http },
+  };
+  r["stream"] = {
+    { "clients", load.stream_clients },
+    { "bytes", counters.stream_bytes.load() },
+    { "frames_per_second", ( metrics["wiight_stream_frames_total"] -
+        start_metrics["wiight_stream_frames_total"] ) / seconds },
+    { "failed", counters.stream_failed.load() },
+  };
+  r["stages"] = StageLatencies( metrics );
+  return r;
+}
+
+// wiight_load [--boards=<n>] [--rate=<hz>] [--reader_cpu=<n>]
+//             [--ws_clients=<m>] [--http_clients=<k>] [--stream_clients=<s>]
+//             [--stream_rate=<hz>] [--interval_ms=<ms>] [--duration=<s>]
+//             [--wiight=<binary>] [--work_dir=<dir>] [--http_port=<n>]
+//             [--api_port=<n>]
+//
+// Starts wiight with n simulated boards, puts the clients on it for the
+// duration, and prints one JSON object of what it sustained.  Progress goes
+// to stderr.
+int main( int argc, char **argv )
+{
+  argh::parser cmdl( argc, argv );
+
+  BenchOptions options;
+  cmdl( "wiight", WIIGHT_BINARY ) >> options.wiight;
+  cmdl( "work_dir", options.work_dir ) >> options.work_dir;
+  cmdl( "http_port", options.http_port ) >> options.http_port;
+  cmdl( "api_port", options.api_port ) >> options.api_port;
+
+  LoadOptions load;
+  cmdl( "boards", load.boards ) >> load.boards;
+  cmdl( "rate", load.rate ) >> load.rate;
+  cmdl( "reader_cpu", load.reader_cpu ) >> load.reader_cpu;
+  cmdl( "ws_clients", load.ws_clients ) >> load.ws_clients;
+  cmdl( "http_clients", load.http_clients ) >> load.http_clients;
+  cmdl( "stream_clients", load.stream_clients ) >> load.stream_clients;
+  cmdl( "stream_rate", load.stream_rate ) >> load.stream_rate;
+  cmdl( "interval_ms", load.interval_ms ) >> load.interval_ms;
+  cmdl( "duration", load.duration ) >> load.duration;
+
+  setenv( "LOGLEVEL", "error", 0 );
+  LogOptions log_options;
+  log_options.async = false;
+  StartLogging( log_options );
+
+  try
+  {
+    printf( "%s\n", RunLoad( options, load ).dump().c_str() );
+  }
+  catch( const exception &e )
+  {
+    fprintf( stderr, "Load test failed: %s\n", e.what() );
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include <unistd.h>
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+#include <fmt/format.h>
+
+#include "bench.h"
+#include "metrics.h"
+#include "process.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// The whole sample path, replay through conversion, settle detection, the
+// live stream and the measurement store, as fast as it goes.
+static json BenchReplay( const BenchOptions &options, uint64_t samples )
+{
+  string log = fmt::format( "{}/wiight_bench.{}.log", options.work_dir,
+                            getpid() );
+  WriteSampleLog( log, samples );
+  json r;
+  try
+  {
+    WiightProcess wiight( options, { "--replay=" + log, "--speed=0",
+                                     "--sync_log" } );
+    auto metrics = wiight.WaitForMetrics();
+    uint64_t start_ns = MonotonicNanos();
+    double start_samples = metrics["wiight_samples_total"];
+    while( metrics["wiight_samples_total"] < samples )
+    {
+      if( MonotonicNanos() - start_ns > 120000000000ULL )
+      {
+        throw runtime_error( fmt::format( "only {} of {} samples processed",
+            metrics["wiight_samples_total"], samples ));
+      }
+      this_thread::sleep_for( chrono::milliseconds( 10 ));
+      metrics = wiight.WaitForMetrics();
+    }
+    double seconds = ( MonotonicNanos() - start_ns ) / 1e9;
+
+    r["samples"] = samples;
+    r["seconds"] = seconds;
+    r["samples_per_second"] = ( samples - start_samples ) / seconds;
+    r["db_rows"] = metrics["wiight_db_rows_total"];
+    r["stages"] = StageLatencies( metrics );
+  }
+  catch( ... )
+  {
+    unlink( log.c_str() );
+    throw;
+  }
+  unlink( log.c_str() );
+  return r;
+}
+
+// Sequential static file requests while a board streams at its real rate.
+static json BenchAssetRequests( const BenchOptions &options, size_t requests )
+{
+  WiightProcess wiight( options, { "--simulate=1", "--sync_log" } );
+  wiight.WaitForMetrics();
+
+  Histogram latency;
+  size_t bytes = 0;
+  uint64_t start_ns = MonotonicNanos();
+  for( size_t idx=0; idx < requests; ++idx )
+  {
+    string body;
+    uint64_t sent_ns = MonotonicNanos();
+    if( !HttpGet( options.http_port, "/wiight.js", &body ))
+    {
+      throw runtime_error( "GET /wiight.js failed" );
+    }
+    latency.Record( MonotonicNanos() - sent_ns );
+    bytes += body.size();
+  }
+  double seconds = ( MonotonicNanos() - start_ns ) / 1e9;
+
+  json r;
+  r["requests_per_second"] = requests / seconds;
+  r["bytes"] = bytes;
+  r["latency"] = Latencies( latency );
+  return r;
+}
+
+// Sequential get_status round trips over the websocket API while a board
+// streams at its real rate.
+static json BenchApiRequests( const BenchOptions &options, size_t requests,
+                              const string &encoding )
+{
+  WiightProcess wiight( options, { "--simulate=1", "--sync_log" } );
+  wiight.WaitForMetrics();
+  ApiClient client( options.api_port, 5000 );
+
+  json request = { { "request", "get_status" } };
+  string message;
+  if( encoding == "msgpack" )
+  {
+    vector<uint8_t> packed = json::to_msgpack( request );
+    message.assign( packed.begin(), packed.end() );
+  }
+  else
+  {
+    message = request.dump();
+    message.push_back( '\0' );
+  }
+
+  Histogram latency;
+  size_t failed = 0;
+  uint64_t start_ns = MonotonicNanos();
+  for( size_t idx=0; idx < requests; ++idx )
+  {
+    string reply;
+    uint64_t sent_ns = MonotonicNanos();
+    if( !client.Request( message, &reply ))
+    {
+      ++failed;
+      continue;
+    }
+    latency.Record( MonotonicNanos() - sent_ns );
+  }
+  double seconds = ( MonotonicNanos() - start_ns ) / 1e9;
+
+  json r;
+  r["requests_per_second"] = ( requests - failed ) / seconds;
+  r["failed"] = failed;
+  r["latency"] = Latencies( latency );
+  return r;
+}
+
+void RegisterMacroBenchmarks( BenchRunner &runner )
+{
+  runner.AddMacro( "process/replay/1000000", []( const BenchOptions &options ) {
+      return BenchReplay( options, 1000000 );
+    });
+  runner.AddMacro( "process/assets/wiight.js", [](
+        const BenchOptions &options ) {
+      return BenchAssetRequests( options, 2000 );
+    });
+  runner.AddMacro( "process/api/get_status/json", [](
+        const BenchOptions &options ) {
+      return BenchApiRequests( options, 2000, "json" );
+    });
+  runner.AddMacro( "process/api/get_status/msgpack", [](
+        const BenchOptions &options ) {
+      return BenchApiRequests( options, 2000, "msgpack" );
+    });
+}
@@ -0,0 +1,344 @@
+#include <unistd.h>
+
+#include <cmath>
+#include <memory>
+#include <random>
+
+#include <event2/event.h>
+#include <fmt/format.h>
+
+#include "api_dispatcher.h"
+#include "asset_cache.h"
+#include "bench.h"
+#include "calibration.h"
+#include "convert.h"
+#include "measurement_store.h"
+#include "sway_analyzer.h"
+#include "thread_pool.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// A database path of our own under dir, removed again by the destructor.
+class ScratchDatabase
+{
+public:
+  ScratchDatabase( const string &dir, const string &name )
+    : path_( fmt::format( "{}/wiight_bench.{}.{}.db", dir, getpid(), name ))
+  {
+    Remove();
+  }
+
+  ~ScratchDatabase ()
+  {
+    Remove();
+  }
+
+  const string& Path () const { return path_; }
+
+private:
+  void Remove ()
+  {
+    for( const char *suffix : { "", "-wal", "-shm" } )
+    {
+      unlink( ( path_ + suffix ).c_str() );
+    }
+  }
+
+  const string path_;
+};
+
+// Samples of someone shifting around on the board, about 160 lb in total.
+static RawBatch SyntheticBatch( size_t n )
+{
+  mt19937 rng( 42 );
+  normal_distribution<double> noise( 0, 30 );
+  RawBatch batch;
+  batch.Reserve( n );
+  for( size_t idx=0; idx < n; ++idx )
+  {
+    RawSample sample;
+    sample.timestamp_us = idx * 10000;
+    for( int corner=0; corner < 4; ++corner )
+    {
+      sample.corners[corner] = int32_t( 1800 + 200 * corner + noise( rng ));
+    }
+    batch.Append( sample );
+  }
+  return batch;
+}
+
+// Calibration points along a slightly bent line, as a real scale gives.
+static void SyntheticCalibration( size_t n, Eigen::VectorXd *wii,
+                                  Eigen::VectorXd *scale )
+{
+  mt19937 rng( 42 );
+  uniform_real_distribution<double> pounds( 20, 300 );
+  normal_distribution<double> noise( 0, 0.2 );
+  wii->resize( n );
+  scale->resize( n );
+  for( size_t idx=0; idx < n; ++idx )
+  {
+    double w = pounds( rng );
+    (*wii)[idx] = w;
+    (*scale)[idx] = 1e-5 * w * w + 1.02 * w + 0.4 + noise( rng );
+  }
+}
+
+static void BenchConvert( BenchRunner &runner )
+{
+  CalibrationModel model;
+  model.coefs = Eigen::Vector3d( 1e-5, 1.02, 0.4 );
+  for( size_t n : { 1, 64, 256, 4096 } )
+  {
+    runner.AddMicro( fmt::format( "convert/quadratic/{}", n ),
+        [n, model]( BenchState &state ) {
+        RawBatch raw = SyntheticBatch( n );
+        ConvertedBatch out;
+        state.SetItemsPerIteration( n );
+        while( state.KeepRunning() )
+        {
+          ConvertBatch( raw, model, &out );
+          DoNotOptimize( out.weight.data() );
+        }
+      });
+  }
+
+  CalibrationModel corner_model = model;
+  corner_model.per_corner = true;
+  corner_model.corner_gains << 1.01, 0.99, 1.02, 0.98;
+  runner.AddMicro( "convert/per_corner/4096", [corner_model](
+        BenchState &state ) {
+      RawBatch raw = SyntheticBatch( 4096 );
+      ConvertedBatch out;
+      state.SetItemsPerIteration( 4096 );
+      while( state.KeepRunning() )
+      {
+        ConvertBatch( raw, corner_model, &out );
+        DoNotOptimize( out.weight.data() );
+      }
+    });
+}
+
+static void BenchCalibration( BenchRunner &runner )
+{
+  for( size_t n : { 10, 100, 1000, 10000, 100000 } )
+  {
+    runner.AddMicro( fmt::format( "calibration/normal_equations/{}", n ),
+        [n]( BenchState &state ) {
+        Eigen::VectorXd wii, scale;
+        SyntheticCalibration( n, &wii, &scale );
+        state.SetItemsPerIteration( n );
+        while( state.KeepRunning() )
+        {
+          DoNotOptimize( FitNormalEquations( wii, scale ));
+        }
+      });
+    runner.AddMicro( fmt::format( "calibration/qr/{}", n ),
+        [n]( BenchState &state ) {
+        Eigen::VectorXd wii, scale;
+        SyntheticCalibration( n, &wii, &scale );
+        state.SetItemsPerIteration( n );
+        while( state.KeepRunning() )
+        {
+          DoNotOptimize( FitQr( wii, scale ));
+        }
+      });
+
+    // What a recalibration costs: reading the points back and fitting them
+    runner.AddMicro( fmt::format( "calibration/refit/{}", n ),
+        [n]( BenchState &state ) {
+        Eigen::VectorXd wii, scale;
+        SyntheticCalibration( n, &wii, &scale );
+        sqlite::database db( ":memory:" );
+        CreateCalibrationTables( db );
+        db << "BEGIN;";
+        for( size_t idx=0; idx < n; ++idx )
+        {
+          db << "INSERT INTO calibration (scale, wii) VALUES (?, ?);"
+            << scale[idx] << wii[idx];
+        }
+        db << "COMMIT;";
+
+        Calibrator calibrator( db );
+        state.SetItemsPerIteration( n );
+        while( state.KeepRunning() )
+        {
+          calibrator.Refit();
+        }
+      });
+  }
+
+  // What adding a point costs: mostly its INSERT into a WAL database, then
+  // the recursive least squares update and publishing the new model
+  const string work_dir = runner.Options().work_dir;
+  runner.AddMicro( "calibration/store_point", [work_dir](
+        BenchState &state ) {
+      ScratchDatabase scratch( work_dir, "store_point" );
+      sqlite::database db = OpenTunedDatabase( scratch.Path() );
+      CreateCalibrationTables( db );
+      for( double w : { 50, 150, 250 } )
+      {
+        db << "INSERT INTO calibration (scale, wii) VALUES (?, ?);" << w << w;
+      }
+      Calibrator calibrator( db );
+      double w = 100;
+      while( state.KeepRunning() )
+      {
+        calibrator.AddPoint( w * 1.01, w );
+        w += 0.01;
+      }
+    });
+}
+
+static void BenchDispatch( BenchRunner &runner )
+{
+  struct Case
+  {
+    const char *name;
+    Encoding encoding;
+    size_t rows;
+  };
+  // get_status sized replies and a day of history sized ones
+  const Case cases[] = {
+    { "dispatch/json/small", Encoding::JSON, 1 },
+    { "dispatch/cbor/small", Encoding::CBOR, 1 },
+    { "dispatch/msgpack/small", Encoding::MSGPACK, 1 },
+    { "dispatch/json/history_1000", Encoding::JSON, 1000 },
+    { "dispatch/cbor/history_1000", Encoding::CBOR, 1000 },
+    { "dispatch/msgpack/history_1000", Encoding::MSGPACK, 1000 },
+  };
+
+  const string work_dir = runner.Options().work_dir;
+  for( const Case &c : cases )
+  {
+    runner.AddMicro( c.name, [c, work_dir]( BenchState &state ) {
+        ScratchDatabase scratch( work_dir, "dispatch" );
+        event_base *base = event_base_new();
+        {
+          ThreadPool pool( base, 1, scratch.Path() );
+          ApiDispatcher api( pool );
+          api.On( "history", [&c]( const json &request ) {
+              (void) request;
+              json r;
+              r["response"] = "history";
+              r["measurements"] = json::array();
+              for( size_t idx=0; idx < c.rows; ++idx )
+              {
+                r["measurements"].push_back( {
+                    { "timestamp_us", 1500000000000000 + idx * 60000000 },
+                    { "weight", 160.0 + idx * 0.001 },
+                    { "stddev", 0.05 },
+                    { "user_id", 1 } } );
+              }
+              return r;
+            });
+
+          string message = ApiDispatcher::Encode(
+            { { "request", "history" }, { "from", 0 }, { "to", -1 } },
+            c.encoding );
+          size_t bytes = 0;
+          while( state.KeepRunning() )
+          {
+            api.Dispatch( message, [&bytes]( const string &reply ) {
+                bytes += reply.size();
+              });
+          }
+          DoNotOptimize( bytes );
+        }
+        event_base_free( base );
+      });
+  }
+}
+
+static void BenchAssets( BenchRunner &runner )
+{
+  runner.AddMicro( "assets/hot/wiight.js", []( BenchState &state ) {
+      AssetCache assets( WIIGHT_SOURCE_DIR );
+      while( state.KeepRunning() )
+      {
+        DoNotOptimize( assets.Get( "/wiight.js" ));
+      }
+    });
+
+  // First request for a file: read, hash and gzip it
+  runner.AddMicro( "assets/cold/jquery", []( BenchState &state ) {
+      while( state.KeepRunning() )
+      {
+        state.PauseTiming();
+        unique_ptr<AssetCache> assets( new AssetCache( WIIGHT_SOURCE_DIR ));
+        state.ResumeTiming();
+        DoNotOptimize( assets->Get( "/jquery-3.2.1.min.js" ));
+        state.PauseTiming();
+        assets.reset();
+        state.ResumeTiming();
+      }
+    });
+}
+
+// One center of pressure sample into the sway window, which should cost the
+// same whatever the window length.
+static void BenchSway( BenchRunner &runner )
+{
+  for( size_t window : { 256, 1024, 4096 } )
+  {
+    runner.AddMicro( fmt::format( "sway/add/{}", window ),
+        [window]( BenchState &state ) {
+        SwayConfig config;
+        config.window = window;
+        SwayAnalyzer sway( config );
+        sway.Begin( 0, 160 );
+        uint64_t t = 0;
+        while( state.KeepRunning() )
+        {
+          t += 10000;
+          sway.Add( t, 3 * sin( t * 1e-6 ), 2 * cos( t * 7e-7 ));
+        }
+        SwayMetrics metrics;
+        sway.Window( &metrics );
+        DoNotOptimize( metrics );
+      });
+  }
+}
+
+// Rows queued and committed by the background writer, at each batch size.
+static void BenchIngest( BenchRunner &runner )
+{
+  static constexpr size_t ROWS = 4096;
+  const string work_dir = runner.Options().work_dir;
+  for( size_t batch_size : { 1, 16, 256, 4096 } )
+  {
+    runner.AddMicro( fmt::format( "ingest/batch_{}", batch_size ),
+        [batch_size, work_dir]( BenchState &state ) {
+        ScratchDatabase scratch( work_dir, "ingest" );
+        MeasurementStore::Options options;
+        options.batch_size = batch_size;
+        options.max_queue = ROWS;
+        MeasurementStore store( scratch.Path(), options );
+
+        Measurement m = {};
+        m.device = 1;
+        m.weight = 160;
+        state.SetItemsPerIteration( ROWS );
+        while( state.KeepRunning() )
+        {
+          for( size_t idx=0; idx < ROWS; ++idx )
+          {
+            m.timestamp_us += 10000;
+            store.Enqueue( m );
+          }
+          store.Flush();
+        }
+      });
+  }
+}
+
+void RegisterMicroBenchmarks( BenchRunner &runner )
+{
+  BenchConvert( runner );
+  BenchCalibration( runner );
+  BenchDispatch( runner );
+  BenchAssets( runner );
+  BenchIngest( runner );
+  BenchSway( runner );
+}
@@ -0,0 +1,269 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fmt/format.h>
+#include <nanomsg/nn.h>
+#include <nanomsg/reqrep.h>
+
+#include "process.h"
+#include "sensor_source.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+/////////////////////////////////////////////////////////////////////////////
+// WiightProcess
+
+WiightProcess::WiightProcess( const BenchOptions &options,
+                              const vector<string> &args )
+  : options_( options ),
+    database_( fmt::format( "{}/wiight_bench.{}.db", options.work_dir,
+                            getpid() ))
+{
+  RemoveDatabase();
+  vector<string> argv_strings = {
+    options.wiight,
+    "--db=" + database_,
+    fmt::format( "--http_port={}", options.http_port ),
+    fmt::format( "--api_url=ws://127.0.0.1:{}", options.api_port ),
+  };
+  argv_strings.insert( argv_strings.end(), args.begin(), args.end() );
+
+  pid_ = fork();
+  if( pid_ < 0 )
+  {
+    throw runtime_error( "fork failed" );
+  }
+  if( pid_ == 0 )
+  {
+    // Served assets are relative to the working directory
+    int null = open( "/dev/null", O_WRONLY );
+    dup2( null, STDOUT_FILENO );
+    dup2( null, STDERR_FILENO );
+    if( chdir( WIIGHT_SOURCE_DIR ) != 0 )
+    {
+      _exit( 127 );
+    }
+    vector<char*> argv;
+    for( auto &arg : argv_strings )
+    {
+      argv.push_back( &arg[0] );
+    }
+    argv.push_back( nullptr );
+    execv( argv[0], argv.data() );
+    _exit( 127 );
+  }
+}
+
+WiightProcess::~WiightProcess ()
+{
+  if( pid_ > 0 )
+  {
+    kill( pid_, SIGINT );
+    int status;
+    waitpid( pid_, &status, 0 );
+  }
+  RemoveDatabase();
+}
+
+void WiightProcess::CheckRunning ()
+{
+  int status;
+  if( pid_ > 0 && waitpid( pid_, &status, WNOHANG ) == pid_ )
+  {
+    pid_ = -1;
+    throw runtime_error( fmt::format( "{} exited with status {}",
+                                      options_.wiight, status ));
+  }
+}
+
+map<string, double> WiightProcess::WaitForMetrics ()
+{
+  for( int attempt=0; attempt < 200; ++attempt )
+  {
+    string body;
+    if( HttpGet( options_.http_port, "/metrics", &body ))
+    {
+      return ParseMetrics( body );
+    }
+    CheckRunning();
+    this_thread::sleep_for( chrono::milliseconds( 50 ));
+  }
+  throw runtime_error( "wiight never served /metrics" );
+}
+
+void WiightProcess::RemoveDatabase ()
+{
+  for( const char *suffix : { "", "-wal", "-shm" } )
+  {
+    unlink( ( database_ + suffix ).c_str() );
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ApiClient
+
+ApiClient::ApiClient( uint16_t port, int timeout_ms )
+{
+  socket_ = nn_socket( AF_SP, NN_REQ );
+  if( socket_ < 0 )
+  {
+    throw runtime_error( fmt::format( "nn_socket failed: {}",
+                                      nn_strerror( nn_errno() )));
+  }
+  nn_setsockopt( socket_, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout_ms,
+                 sizeof( timeout_ms ));
+  nn_setsockopt( socket_, NN_SOL_SOCKET, NN_SNDTIMEO, &timeout_ms,
+                 sizeof( timeout_ms ));
+
+  string url = fmt::format( "ws://127.0.0.1:{}", port );
+  if( nn_connect( socket_, url.c_str() ) < 0 )
+  {
+    int err = nn_errno();
+    nn_close( socket_ );
+    throw runtime_error( fmt::format( "nn_connect to {} failed: {}", url,
+                                      nn_strerror( err )));
+  }
+}
+
+ApiClient::~ApiClient ()
+{
+  nn_close( socket_ );
+}
+
+bool ApiClient::Request( const string &message, string *reply )
+{
+  if( nn_send( socket_, message.data(), message.size(), 0 ) < 0 )
+  {
+    return false;
+  }
+  char *buf = nullptr;
+  int bytes = nn_recv( socket_, &buf, NN_MSG, 0 );
+  if( bytes < 0 )
+  {
+    return false;
+  }
+  reply->assign( buf, bytes );
+  nn_freemsg( buf );
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+bool HttpGet( uint16_t port, const string &path, string *body )
+{
+  int fd = socket( AF_INET, SOCK_STREAM, 0 );
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons( port );
+  addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  if( connect( fd, reinterpret_cast<sockaddr*>( &addr ), sizeof( addr )) < 0 )
+  {
+    close( fd );
+    return false;
+  }
+
+  string request = "GET " + path + " HTTP/1.0\r\n\r\n";
+  if( write( fd, request.data(), request.size() ) !=
+      ssize_t( request.size() ))
+  {
+    close( fd );
+    return false;
+  }
+  string response;
+  char buf[65536];
+  ssize_t n;
+  while( (n = read( fd, buf, sizeof( buf ))) > 0 )
+  {
+    response.append( buf, n );
+  }
+  close( fd );
+
+  size_t start = response.find( "\r\n\r\n" );
+  if( response.compare( 0, 12, "HTTP/1.0 200" ) != 0 &&
+      response.compare( 0, 12, "HTTP/1.1 200" ) != 0 )
+  {
+    return false;
+  }
+  *body = start == string::npos ? string() : response.substr( start + 4 );
+  return true;
+}
+
+map<string, double> ParseMetrics( const string &text )
+{
+  map<string, double> metrics;
+  istringstream lines( text );
+  string line;
+  while( getline( lines, line ))
+  {
+    size_t space = line.rfind( ' ' );
+    if( line.empty() || line[0] == '#' || space == string::npos )
+    {
+      continue;
+    }
+    metrics[ line.substr( 0, space ) ] = stod( line.substr( space + 1 ));
+  }
+  return metrics;
+}
+
+json StageLatencies( const map<string, double> &metrics )
+{
+  json stages;
+  for( const auto &metric : metrics )
+  {
+    const string &name = metric.first;
+    size_t at = name.find( "_seconds{quantile=\"" );
+    if( name.compare( 0, 7, "wiight_" ) != 0 || at == string::npos )
+    {
+      continue;
+    }
+    string stage = name.substr( 7, at - 7 );
+    auto count = metrics.find( "wiight_" + stage + "_seconds_count" );
+    if( count == metrics.end() || count->second == 0 )
+    {
+      continue;
+    }
+    string q = name.substr( at + 19, name.size() - at - 21 );
+    stages[stage]["count"] = count->second;
+    stages[stage][( q == "0.5" ? "p50" : "p" + q.substr( 2 )) + "_us"] =
+      metric.second * 1e6;
+  }
+  return stages;
+}
+
+json Latencies( const Histogram &histogram )
+{
+  unique_ptr<Histogram::Snapshot> snapshot( new Histogram::Snapshot );
+  histogram.Collect( snapshot.get() );
+  return {
+    { "count", snapshot->count },
+    { "mean_us", snapshot->count ?
+        snapshot->sum / 1e3 / snapshot->count : 0.0 },
+    { "p50_us", snapshot->Quantile( 0.5 ) / 1e3 },
+    { "p99_us", snapshot->Quantile( 0.99 ) / 1e3 },
+    { "p999_us", snapshot->Quantile( 0.999 ) / 1e3 },
+  };
+}
+
+void WriteSampleLog( const string &path, uint64_t count )
+{
+  unlink( path.c_str() );
+  RecordingSource recorder( unique_ptr<SensorSource>(
+      new SimulatedSource( 0, 0, count )), path );
+  RawSample samples[256];
+  while( recorder.Read( samples, 256 ) >= 0 )
+  {
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef  PROCESS_H_
+#define  PROCESS_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+
+#include "bench.h"
+#include "metrics.h"
+
+// A wiight process of our own on a scratch database and options' ports,
+// for the macro benchmarks and the load generator to drive from outside.
+// Stopped with SIGINT like an operator would, and its database removed.
+class WiightProcess
+{
+public:
+  // Starts options.wiight with args after the database and port flags.
+  WiightProcess( const BenchOptions &options,
+                 const std::vector<std::string> &args );
+  ~WiightProcess ();
+
+  WiightProcess ( const WiightProcess& ) = delete;
+  WiightProcess& operator= ( const WiightProcess& ) = delete;
+
+  // Throws if the process has exited.
+  void CheckRunning ();
+
+  // Waits for the process to serve /metrics, returning them.  Throws if it
+  // exits or doesn't within 10 s.
+  std::map<std::string, double> WaitForMetrics ();
+
+private:
+  void RemoveDatabase ();
+
+  const BenchOptions &options_;
+  const std::string database_;
+  pid_t pid_;
+};
+
+// Blocking client of the websocket API, speaking rep.sp.nanomsg.org like
+// wiight.js.  One request in flight at a time.
+class ApiClient
+{
+public:
+  // Throws if the socket can't be set up.
+  ApiClient( uint16_t port, int timeout_ms );
+  ~ApiClient ();
+
+  ApiClient ( const ApiClient& ) = delete;
+  ApiClient& operator= ( const ApiClient& ) = delete;
+
+  // Sends message and waits for the reply.  False on an error or timeout.
+  bool Request( const std::string &message, std::string *reply );
+
+private:
+  int socket_;
+};
+
+// Body of GET path from 127.0.0.1:port over a fresh HTTP/1.0 connection, or
+// false if nothing is listening or the status isn't 200.
+bool HttpGet( uint16_t port, const std::string &path, std::string *body );
+
+// Series and values of a Prometheus text exposition, labels included in the
+// series name.
+std::map<std::string, double> ParseMetrics( const std::string &text );
+
+// The server side stage latencies in microseconds from parsed metrics, for
+// every stage that saw any work.
+nlohmann::json StageLatencies( const std::map<std::string, double> &metrics );
+
+// Count, mean and quantiles of a histogram in microseconds.
+nlohmann::json Latencies( const Histogram &histogram );
+
+// Records count samples of a SimulatedSource, played flat out, to a log for
+// --replay.
+void WriteSampleLog( const std::string &path, uint64_t count );
+
+#endif  // #ifndef  PROCESS_H_
@@ -0,0 +1,78 @@
+#ifndef  API_DISPATCHER_H_
+#define  API_DISPATCHER_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include <json.hpp>
+#include <sqlite_modern_cpp.h>
+
+#include "thread_pool.h"
+
+// Wire encodings of API messages.  NUL terminated JSON text stays the default
+// and is easy to debug; CBOR and MessagePack are far cheaper to produce and
+// parse for large responses such as history.
+enum class Encoding { JSON, CBOR, MSGPACK };
+
+// Routes websocket API requests to handlers keyed on their "request" field.
+//
+// Cheap handlers run inline on the loop.  Pooled handlers (history queries,
+// recalibration) run on a ThreadPool worker with its own database
+// connection, so a slow request never holds up the ones behind it; their
+// reply is sent from the loop once they finish.  A handler that throws, or a
+// request that doesn't parse, gets an "error" response.
+//
+// Requests may come in any Encoding, told apart by their first byte.  The
+// reply uses the request's encoding unless the request names another with
+// "encoding": "json" | "cbor" | "msgpack".
+class ApiDispatcher
+{
+public:
+  using json = nlohmann::json;
+  using Reply = std::function<void( const std::string &reply )>;
+  using Handler = std::function<json( const json &request )>;
+  using PoolHandler =
+    std::function<json( const json &request, sqlite::database &db )>;
+
+  explicit ApiDispatcher( ThreadPool &pool );
+
+  ApiDispatcher ( const ApiDispatcher& ) = delete;
+  ApiDispatcher& operator= ( const ApiDispatcher& ) = delete;
+
+  void On( const std::string &request, Handler handler );
+  void OnPool( const std::string &request, PoolHandler handler );
+
+  // Answers message through reply, now or from a pool completion.  Loop
+  // thread only.
+  void Dispatch( const std::string &message, Reply reply );
+
+  // A message's encoding from its first byte: an object in JSON text, or a
+  // CBOR or MessagePack map.
+  static Encoding Detect( const std::string &message );
+  static json Decode( const std::string &message, Encoding encoding );
+  static std::string Encode( const json &message, Encoding encoding );
+
+  uint64_t Handled () const { return handled_; }
+  uint64_t Failed () const { return failed_; }
+
+  static json ErrorResponse( const std::string &what );
+
+private:
+  // Encoding named by request["encoding"], else fallback.
+  static Encoding ReplyEncoding( const json &request, Encoding fallback );
+
+  struct Route
+  {
+    Handler handler;
+    PoolHandler pool_handler;
+  };
+
+  ThreadPool &pool_;
+  std::unordered_map<std::string, Route> routes_;
+  uint64_t handled_;
+  uint64_t failed_;
+};
+
+#endif  // #ifndef  API_DISPATCHER_H_
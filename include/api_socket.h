@@ -0,0 +1,69 @@
+#ifndef  API_SOCKET_H_
+#define  API_SOCKET_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include <event2/event.h>
+
+// The nanomsg REP websocket endpoint, driven from a libevent loop through the
+// socket's NN_RCVFD/NN_SNDFD descriptors instead of blocking calls.
+//
+// The socket is raw (AF_SP_RAW), so any number of requests can be in flight:
+// each keeps the routing header nanomsg received it with, and Reply() sends
+// the answer back under that header whenever it is ready, in any order.
+// Receiving pauses while max_in_flight requests are unanswered.
+class ApiSocket
+{
+public:
+  // Requests are passed on as the bytes received.
+  using Handler = std::function<void( uint64_t id, const std::string &request )>;
+
+  ApiSocket( event_base *base, const std::string &url, Handler handler,
+             size_t max_in_flight = 256 );
+  ~ApiSocket ();
+
+  ApiSocket ( const ApiSocket& ) = delete;
+  ApiSocket& operator= ( const ApiSocket& ) = delete;
+
+  // Answers request id with reply's bytes as they are.  Must be called on
+  // the loop's thread; replies that can't go right away are queued on
+  // NN_SNDFD.
+  void Reply( uint64_t id, const std::string &reply );
+
+  size_t InFlight () const { return headers_.size(); }
+
+private:
+  struct Pending
+  {
+    void *header;
+    uint64_t received_ns;
+  };
+
+  struct Unsent
+  {
+    Pending pending;
+    std::string body;
+  };
+
+  static void ReadableCallback( evutil_socket_t fd, short what, void *arg );
+  static void WritableCallback( evutil_socket_t fd, short what, void *arg );
+
+  void Receive ();
+  void Send ();
+
+  const Handler handler_;
+  const size_t max_in_flight_;
+  int socket_;
+  event *readable_;
+  event *writable_;
+  bool receiving_;
+  uint64_t next_id_;
+  std::unordered_map<uint64_t, Pending> headers_;
+  std::deque<Unsent> unsent_;
+};
+
+#endif  // #ifndef  API_SOCKET_H_
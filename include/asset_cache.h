@@ -0,0 +1,62 @@
+#ifndef  ASSET_CACHE_H_
+#define  ASSET_CACHE_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// A static file held in memory, immutable once loaded so it can be handed to
+// libevent by reference.  The file is read rather than mapped: editors and
+// deploys that truncate in place would otherwise change or SIGBUS a body
+// that is still being sent.  The gzip variant is compressed once at load.
+struct Asset
+{
+  std::string mime;
+  std::string etag;   // Strong validator, quoted, from the content hash
+  std::string body;
+  std::string gzip;   // Empty if compression didn't pay off
+};
+
+// Serves files under root from memory.  Files are loaded on first request and
+// stay cached until inotify reports a change to them, so repeat requests do
+// no filesystem work at all.
+class AssetCache
+{
+public:
+  explicit AssetCache( const std::string &root );
+  ~AssetCache ();
+
+  // Looks up a URL path such as "/wiight.js", "/" meaning "/index.html".
+  // Returns nullptr for missing files and paths that escape root.
+  std::shared_ptr<const Asset> Get( const std::string &url_path );
+
+  // Readable when files changed.  Call ProcessEvents() when it is.
+  int Fd () const { return inotify_fd_; }
+  void ProcessEvents ();
+
+private:
+  std::shared_ptr<const Asset> Load( const std::string &rel_path );
+  void Watch( const std::string &dir );
+
+  const std::string root_;
+  int inotify_fd_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const Asset>> assets_;
+  std::unordered_map<int, std::string> watches_;  // wd -> directory
+};
+
+// MIME type from a file name's extension.
+const char* MimeType( const std::string &path );
+
+// True if an Accept-Encoding value takes gzip: named, or covered by "*",
+// with a q-value above 0.  An explicit gzip entry overrides "*".
+bool AcceptsGzip( const std::string &accept_encoding );
+
+// True if an If-None-Match value, "*" or a comma separated list of entity
+// tags, matches etag.  Weak comparison, as RFC 7232 has If-None-Match use.
+bool EtagMatches( const std::string &if_none_match, const std::string &etag );
+
+#endif  // #ifndef  ASSET_CACHE_H_
@@ -0,0 +1,108 @@
+#ifndef  CALIBRATION_H_
+#define  CALIBRATION_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include <Eigen/Dense>
+#include <sqlite_modern_cpp.h>
+
+// Raw corner units (10 g) to pounds.
+static constexpr double RAW_TO_POUNDS = 2.20462 / 100.0;
+
+// Fitted mapping from board readings to scale pounds.  Immutable once
+// published; a refit or new calibration point produces a new version.
+struct CalibrationModel
+{
+  uint64_t version = 0;
+
+  // scale = c0*w^2 + c1*w + c2 where w is the summed corners in pounds
+  Eigen::Vector3d coefs = Eigen::Vector3d( 0, 1, 0 );
+
+  // Optional per-corner model, scale = gains.dot( corners ) + offset, used
+  // once enough corner calibration points exist to pin each load cell down.
+  bool per_corner = false;
+  Eigen::Matrix<double, 4, 1, Eigen::DontAlign> corner_gains =
+    Eigen::Vector4d::Ones();
+  double corner_offset = 0;
+
+  // Calibrated weight from the four corners in pounds.
+  double Weight( const Eigen::Vector4d &pounds ) const
+  {
+    if( per_corner )
+    {
+      return corner_gains.dot( pounds ) + corner_offset;
+    }
+    double w = pounds.sum();
+    return coefs[0]*w*w + coefs[1]*w + coefs[2];
+  }
+};
+
+// Quadratic least squares fit of scale against wii readings, solved through
+// the normal equations.  Cheap, but squares the condition number.
+Eigen::VectorXd FitNormalEquations( const Eigen::VectorXd &wii,
+                                    const Eigen::VectorXd &scale );
+
+// Same fit via Householder QR of the design matrix, which stays accurate for
+// large or badly conditioned calibration sets.
+Eigen::VectorXd FitQr( const Eigen::VectorXd &wii,
+                       const Eigen::VectorXd &scale );
+
+// Reads the calibration table and fits it.  Kept for one-off use; the
+// sampling path should use a Calibrator instead.
+Eigen::VectorXd GetCalibrationCoefficients( sqlite::database &db );
+
+// Creates the calibration and corner_calibration tables a Calibrator reads,
+// or adds the device column to tables from before per-device profiles.
+void CreateCalibrationTables( sqlite::database &db );
+
+// Owns the current CalibrationModel.  The model is fitted from SQLite once at
+// startup; after that calibration points update it by recursive least
+// squares and the result is swapped in atomically, so readers never touch
+// the database or block on a writer.
+//
+// Each board has its own profile, the calibration rows tagged with its device
+// id.  Device 0 is the shared profile: a board with fewer than three points
+// of its own is fitted from those together with the shared points.
+class Calibrator
+{
+public:
+  explicit Calibrator( sqlite::database &db, uint32_t device = 0 );
+
+  // Lock-free snapshot of the model, safe to call from the sensor thread.
+  std::shared_ptr<const CalibrationModel> Current () const;
+
+  // Persists a point from a reference scale and updates the model.
+  void AddPoint( double scale, double wii );
+
+  // Same, but with the individual corner readings (pounds) behind wii.
+  void AddCornerPoint( double scale, const Eigen::Vector4d &corners );
+
+  // Discards the recursive state and refits everything from the database.
+  void Refit ();
+
+  uint32_t Device () const { return device_; }
+
+  // True while the quadratic model leans on the shared profile's points.
+  bool Borrowed () const { return borrowed_.load(); }
+
+private:
+  void Publish( CalibrationModel model );
+
+  sqlite::database &db_;
+  const uint32_t device_;
+  std::atomic<bool> borrowed_;
+  std::mutex write_mutex_;
+  std::shared_ptr<const CalibrationModel> model_;
+
+  // Recursive least squares state, P is the inverse information matrix
+  Eigen::Vector3d theta_;
+  Eigen::Matrix3d p_;
+  Eigen::Matrix<double, 5, 1> corner_theta_;
+  Eigen::Matrix<double, 5, 5> corner_p_;
+  size_t corner_points_;
+};
+
+#endif  // #ifndef  CALIBRATION_H_
@@ -0,0 +1,53 @@
+#ifndef  CONVERT_H_
+#define  CONVERT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "calibration.h"
+#include "sensor_source.h"
+
+// Distance between the load cells, used to put the center of pressure in mm
+static constexpr double BOARD_WIDTH_MM = 433.0;
+static constexpr double BOARD_LENGTH_MM = 238.0;
+
+// Corner indices into RawSample::corners, which follow xwiimote's abs[] order
+enum Corner { TOP_RIGHT = 0, BOTTOM_LEFT = 1, TOP_LEFT = 2, BOTTOM_RIGHT = 3 };
+
+// Structure-of-arrays block of raw samples, the layout the conversion kernel
+// vectorizes over.
+struct RawBatch
+{
+  std::vector<uint64_t> timestamp_us;
+  std::vector<int32_t> corners[4];
+
+  size_t Size () const { return timestamp_us.size(); }
+  void Clear ();
+  void Reserve( size_t n );
+  void Append( const RawSample &sample );
+  void Append( const RawSample *samples, size_t n );
+};
+
+// Calibrated output for a RawBatch, index for index.
+struct ConvertedBatch
+{
+  std::vector<double> weight;  // Pounds
+  std::vector<double> cop_x;   // Center of pressure in mm, + is right
+  std::vector<double> cop_y;   // ...and + is toward the top of the board
+
+  size_t Size () const { return weight.size(); }
+  void Resize( size_t n );
+};
+
+// Converts n samples given as four corner arrays in one pass.  Outputs may
+// not alias the inputs.  Samples under ~1 lb total get a center of pressure
+// of zero rather than a division by noise.
+void ConvertBatch( const int32_t *const corners[4], size_t n,
+                   const CalibrationModel &model,
+                   double *weight, double *cop_x, double *cop_y );
+
+void ConvertBatch( const RawBatch &raw, const CalibrationModel &model,
+                   ConvertedBatch *out );
+
+#endif  // #ifndef  CONVERT_H_
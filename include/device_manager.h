@@ -0,0 +1,153 @@
+#ifndef  DEVICE_MANAGER_H_
+#define  DEVICE_MANAGER_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <event2/event.h>
+#include <sqlite_modern_cpp.h>
+
+#include "calibration.h"
+#include "measurement_store.h"
+#include "sample_pipeline.h"
+#include "sample_ring.h"
+#include "sensor_reader.h"
+#include "sensor_source.h"
+
+struct xwii_monitor;
+
+// Counters of one board, as reported by get_status.
+struct DeviceStats
+{
+  uint32_t id;
+  std::string address;
+  bool connected;
+  uint64_t samples;
+  uint64_t dropped;
+  uint64_t reconnects;
+  double rate;          // Samples a second over the last stats interval
+};
+
+// Every balance board connected to this host, each with its own ring,
+// SamplePipeline and calibration profile, all read on one event loop.
+//
+// Watch() keeps the xwiimote hotplug monitor's descriptor on the loop and
+// opens each balance board that appears.  Boards are known by their
+// bluetooth address and numbered in a devices table, so a board that drops
+// out and comes back, even across restarts, keeps its device id, pipeline
+// and counters; only its source is replaced.
+//
+// Loop thread only, except CalibrationFor().
+class DeviceManager
+{
+public:
+  using EventHandler =
+    std::function<void( uint32_t device, const SettleEvent &event )>;
+  using BatchHandler = std::function<void( uint32_t device, const RawBatch&,
+                                           const ConvertedBatch& )>;
+  using SwayHandler =
+    std::function<void( uint32_t device, const SwayMetrics &sway )>;
+
+  DeviceManager( event_base *base, sqlite::database &db,
+                 MeasurementStore &store );
+  ~DeviceManager ();
+
+  DeviceManager ( const DeviceManager& ) = delete;
+  DeviceManager& operator= ( const DeviceManager& ) = delete;
+
+  // Set before any board is attached.
+  void OnEvent( EventHandler handler ) { on_event_ = std::move( handler ); }
+  void OnBatch( BatchHandler handler ) { on_batch_ = std::move( handler ); }
+  void OnSway( SwayHandler handler ) { on_sway_ = std::move( handler ); }
+  void OnSession( SamplePipeline::SessionHandler handler )
+  {
+    on_session_ = std::move( handler );
+  }
+  void Identify( SamplePipeline::Identifier identifier )
+  {
+    identify_ = std::move( identifier );
+  }
+
+  // Appends the samples of every board opened from now on to a log at
+  // <prefix>.<device id>.
+  void Record( const std::string &prefix ) { record_prefix_ = prefix; }
+
+  // Opens the boards already connected and watches for more.  Throws if
+  // there is no hotplug monitor.
+  void Watch ();
+
+  // Adds a source that isn't hotplugged, such as a replayed log, under
+  // address.  It is read on the loop, or by a reader thread pinned to
+  // reader_cpu if that isn't negative.  Returns its device id.
+  uint32_t Attach( const std::string &address,
+                   std::unique_ptr<SensorSource> source, int reader_cpu = -1 );
+
+  // Calibration profile of device, 0 being the shared profile.  Throws for
+  // an unknown device.  Safe from any thread.
+  Calibrator& CalibrationFor( uint32_t device );
+
+  // Refits every board still leaning on the shared profile, after it gained
+  // a point.
+  void SharedCalibrationChanged ();
+
+  // Devices whose weights come from the shared profile: 0, for rows from
+  // before per-device profiles, and every board still Borrowed().  Safe from
+  // any thread.
+  std::vector<uint32_t> SharedProfileDevices () const;
+
+  std::vector<DeviceStats> Stats () const;
+
+private:
+  struct Device
+  {
+    uint32_t id;
+    std::string address;
+    std::unique_ptr<Calibrator> calibrator;
+    std::unique_ptr<SampleRing<RawSample>> ring;
+    std::unique_ptr<SamplePipeline> pipeline;
+    std::unique_ptr<SensorReader> reader;
+    bool connected;
+    uint64_t connects;
+    uint64_t rate_samples;  // Samples processed at the last stats tick
+    double rate;
+  };
+
+  static void MonitorCallback( evutil_socket_t fd, short what, void *arg );
+  static void StatsCallback( evutil_socket_t fd, short what, void *arg );
+
+  // Opens every device path the monitor has to report.
+  void Scan ();
+  void Open( const std::string &path );
+
+  // The device known by address, created and numbered on first sight.
+  Device& Find( const std::string &address );
+  void Connected( Device *device );
+
+  event_base *base_;
+  sqlite::database &db_;
+  MeasurementStore &store_;
+  EventHandler on_event_;
+  BatchHandler on_batch_;
+  SwayHandler on_sway_;
+  SamplePipeline::SessionHandler on_session_;
+  SamplePipeline::Identifier identify_;
+  std::string record_prefix_;
+
+  ::xwii_monitor *monitor_;
+  event *monitor_event_;
+  event *stats_timer_;
+  uint64_t stats_us_;
+
+  Calibrator shared_;
+  // Devices are never removed, so references into the map stay valid.  The
+  // mutex only guards lookups from other threads against insertion.
+  mutable std::mutex devices_mutex_;
+  std::map<uint32_t, Device> devices_;
+};
+
+#endif  // #ifndef  DEVICE_MANAGER_H_
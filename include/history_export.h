@@ -0,0 +1,55 @@
+#ifndef  HISTORY_EXPORT_H_
+#define  HISTORY_EXPORT_H_
+
+#include <atomic>
+#include <cstddef>
+
+#include <evhtp.h>
+
+// Streams measurement history out of the database as CSV or NDJSON, with
+// chunked transfer encoding so nothing is ever held as one response.
+//
+// An export pages through the table on the read connection of the thread
+// serving it, one batch of rows per query.  The next batch is only fetched
+// once the connection's unsent output has drained below low_water, from
+// evhtp's write hook, so a slow client holds at most a batch or so in
+// memory however long the history is.  Between batches the thread is back
+// in its loop serving other requests, and no read transaction is left open
+// to hold WAL checkpoints back.  Each batch reads its own snapshot, so rows
+// stored while an export runs may make it in at the end.
+class HistoryExport
+{
+public:
+  struct Options
+  {
+    size_t batch_rows = 1024;       // Rows fetched per write
+    size_t low_water = 16 * 1024;   // Unsent bytes the next batch waits for
+  };
+
+  explicit HistoryExport( const Options &options );
+  HistoryExport ();
+
+  HistoryExport ( const HistoryExport& ) = delete;
+  HistoryExport& operator= ( const HistoryExport& ) = delete;
+
+  // evhtp handler for
+  //   GET <path>[?format=csv|ndjson][&user_id=<id>][&device=<id>]
+  //             [&start_us=<t0>][&end_us=<t1>]
+  // A user's rows come in time order; without user_id, all rows come in the
+  // order they were stored, which is time order per board.  CSV by default.
+  // Must outlive the HttpServer it is registered on.
+  static void ExportCallback( evhtp_request_t *req, void *arg );
+
+  size_t Exports () const { return exports_.load(); }
+
+private:
+  struct Export;
+
+  static evhtp_res WriteCallback( evhtp_connection_t *conn, void *arg );
+  static evhtp_res FinishedCallback( evhtp_request_t *req, void *arg );
+
+  const Options options_;
+  std::atomic<size_t> exports_;
+};
+
+#endif  // #ifndef  HISTORY_EXPORT_H_
@@ -0,0 +1,89 @@
+#ifndef  HTTP_SERVER_H_
+#define  HTTP_SERVER_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <evhtp.h>
+#include <sqlite_modern_cpp.h>
+
+#include "asset_cache.h"
+
+// State owned by one request handling thread.  Handlers get the one for the
+// thread they run on through HttpServer::State().
+struct HttpThreadState
+{
+  explicit HttpThreadState( const std::string &database );
+
+  sqlite::database db;  // Read connection, never shared across threads
+};
+
+// The evhtp front end.  Static files are served from an AssetCache by the
+// catch-all handler, other paths can be added with AddHandler().  With
+// threads > 0 connections are spread over that many evhtp worker threads,
+// each with its own HttpThreadState; otherwise everything runs on Run()'s
+// thread.
+class HttpServer
+{
+public:
+  struct Options
+  {
+    std::string address = "0.0.0.0";
+    uint16_t port = 8080;
+    int threads = 0;
+    std::string root = ".";
+    std::string database;
+  };
+
+  explicit HttpServer( const Options &options );
+  ~HttpServer ();
+
+  HttpServer ( const HttpServer& ) = delete;
+  HttpServer& operator= ( const HttpServer& ) = delete;
+
+  // Exact path handler.  Register before Run().
+  void AddHandler( const std::string &path, evhtp_callback_cb cb, void *arg );
+
+  // Runs handler on the server's loop when signum arrives.
+  void OnSignal( int signum, std::function<void()> handler );
+
+  // Serves until Stop().
+  void Run ();
+
+  // Makes Run() return.  Safe to call from any thread, including handlers.
+  void Stop ();
+
+  evbase_t* Base () { return evbase_; }
+  AssetCache& Assets () { return assets_; }
+
+  // Per-thread state of the thread handling req.
+  static HttpThreadState& State( evhtp_request_t *req );
+
+private:
+  struct Signal
+  {
+    event *ev;
+    std::function<void()> handler;
+  };
+
+  static void RootCallback( evhtp_request_t *req, void *arg );
+  static void AssetChangedCallback( evutil_socket_t fd, short what, void *arg );
+  static void StopCallback( evutil_socket_t fd, short what, void *arg );
+  static void SignalCallback( evutil_socket_t fd, short what, void *arg );
+  static void InitThread( evhtp_t *htp, evthr_t *thr, void *arg );
+  static void ExitThread( evhtp_t *htp, evthr_t *thr, void *arg );
+
+  const Options options_;
+  AssetCache assets_;
+  evbase_t *evbase_;
+  evhtp_t *htp_;
+  event *asset_changed_;
+  event *stop_;
+  std::vector<std::unique_ptr<Signal>> signals_;
+  HttpThreadState main_state_;
+};
+
+#endif  // #ifndef  HTTP_SERVER_H_
@@ -0,0 +1,123 @@
+#ifndef  LIVE_STREAM_H_
+#define  LIVE_STREAM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <evhtp.h>
+
+#include "convert.h"
+#include "sample_ring.h"
+#include "settle_detector.h"
+#include "sway_analyzer.h"
+
+// One calibrated sample as streamed to clients.
+struct LiveSample
+{
+  uint64_t timestamp_us;
+  double weight;
+  double cop_x;
+  double cop_y;
+  uint32_t device;
+  uint64_t published_ns;  // MonotonicNanos() when the pipeline published it
+};
+
+// A settle event and the board it happened on.
+struct LiveEvent
+{
+  uint32_t device;
+  SettleEvent event;
+  uint64_t published_ns;
+};
+
+// The sway window of a board as streamed to clients.
+struct LiveSway
+{
+  uint32_t device;
+  SwayMetrics sway;
+  uint64_t published_ns;
+};
+
+// One frame of the binary stream: eight doubles in host (little endian)
+// order, so a browser can view a run of frames as a Float64Array without
+// parsing anything.
+//
+// Sway frames (kind 4) reuse the slots: weight is the window's path length,
+// cop_x and cop_y its RMS and 95% ellipse area, stddev the mean velocity and
+// confidence the mean frequency.  The spectrum is only in the text stream.
+struct LiveFrame
+{
+  double kind;          // 0 sample, 1 + SettleEvent::Type for events, 4 sway
+  double timestamp_us;
+  double weight;
+  double cop_x;         // Samples only
+  double cop_y;
+  double stddev;        // Settle events only
+  double confidence;
+  double device;
+};
+static_assert( sizeof( LiveFrame ) == 64, "LiveFrame is a fixed wire layout" );
+
+// Fans live samples, settle events and sway windows out to any number of HTTP
+// subscribers as a text/event-stream (Server-Sent Events), or with
+// ?format=binary as an application/octet-stream of packed LiveFrames.  Every
+// board publishes into the same stream; ?device=<id> subscribes to just one
+// of them.
+//
+// The sample loop publishes into rings and never waits on a subscriber.  Each
+// subscriber has its own cursors and a timer, on the thread serving its
+// connection, that sends at the rate it asked for.  Samples and sway windows
+// are coalesced: a tick sends only the newest of each board, and a tick that
+// finds the connection still holding more than high_water unsent bytes sends
+// nothing, so a slow client gets the latest value instead of a backlog.
+// Settle events are not coalesced.
+class LiveStream
+{
+public:
+  struct Options
+  {
+    size_t capacity = 1024;        // Samples kept for subscribers, ~10 s
+    double default_rate = 10;      // Sample frames a second without ?rate=
+    double max_rate = 100;
+    size_t high_water = 64 * 1024; // Unsent bytes before ticks are skipped
+  };
+
+  explicit LiveStream( const Options &options );
+  LiveStream ();
+
+  LiveStream ( const LiveStream& ) = delete;
+  LiveStream& operator= ( const LiveStream& ) = delete;
+
+  // Producer side, from a single thread.
+  void Publish( uint32_t device, const RawBatch &raw,
+                const ConvertedBatch &converted );
+  void Publish( uint32_t device, const SettleEvent &event );
+  void Publish( uint32_t device, const SwayMetrics &sway );
+
+  // evhtp handler for
+  //   GET <path>[?rate=<frames per second>][&format=binary][&device=<id>]
+  // Must outlive the HttpServer it is registered on.
+  static void StreamCallback( evhtp_request_t *req, void *arg );
+
+  size_t Subscribers () const { return subscribers_.load(); }
+
+  // Samples a subscriber skipped because a newer one was sent instead.
+  uint64_t Coalesced () const { return coalesced_.load(); }
+
+private:
+  struct Subscriber;
+
+  static void TickCallback( evutil_socket_t fd, short what, void *arg );
+  static evhtp_res FinishedCallback( evhtp_request_t *req, void *arg );
+
+  const Options options_;
+  SampleRing<LiveSample> samples_;
+  SampleRing<LiveEvent> events_;
+  SampleRing<LiveSway> sways_;
+  std::atomic<size_t> subscribers_;
+  std::atomic<uint64_t> coalesced_;
+};
+
+#endif  // #ifndef  LIVE_STREAM_H_
@@ -1,6 +1,7 @@
 #ifndef  LOGGING_H_
 #define  LOGGING_H_
 
+#include <cstddef>
 #include <memory>
 #include <stdexcept>
 
@@ -8,12 +9,46 @@
 
 #include "stacktrace.h"
 
-// Returns a shared pointer to the current default log named "console"
-std::shared_ptr<spdlog::logger> Log();
+// Compile-time floor for WARN/INFO/DEBUG.  Macros below it still compile, so
+// their arguments stay checked, but sit behind if( false ) and generate no
+// code.  ERROR and FATAL are always on.  Set with -DWIIGHT_LOG_LEVEL=<n>.
+#define WIIGHT_LOG_DEBUG 0
+#define WIIGHT_LOG_INFO  1
+#define WIIGHT_LOG_WARN  2
+#ifndef WIIGHT_LOG_LEVEL
+#define WIIGHT_LOG_LEVEL WIIGHT_LOG_DEBUG
+#endif
+
+struct LogOptions
+{
+  // Formatting and writing happen on spdlog's worker thread, callers only
+  // queue the message
+  bool async = true;
+  size_t queue_size = 8192;  // Messages, a power of 2
+  // A full queue drops messages rather than block the loop or the sensor
+  bool block_when_full = false;
+};
+
+// Creates the "console" logger.  Call before anything logs, or the first log
+// creates a synchronous one.  The runtime level comes from $LOGLEVEL.  An
+// async logger writes out what is still queued when it is destroyed at exit.
+void StartLogging( const LogOptions &options );
+
+spdlog::logger* CreateLog ();
+
+// The "console" logger, looked up once and cached, so a log call costs no
+// registry lookup or reference count.
+inline spdlog::logger* Log ()
+{
+  static spdlog::logger *log = CreateLog();
+  return log;
+}
 
 #define STRINGISE(X) #X
 #define FANCY_LOG(level, msg, ...) Log()->level("{}:{} | " msg, __FILE__, \
                                                __LINE__, ##__VA_ARGS__)
+#define NO_LOG(level, ...) do { if( false ) { FANCY_LOG(level, __VA_ARGS__); } \
+                              } while( 0 )
 
 #define FATAL_THROW(msg, ...)                               \
   PrintStack();                                             \
@@ -21,8 +56,23 @@ std::shared_ptr<spdlog::logger> Log();
 
 #define FATAL(...) FANCY_LOG(error, __VA_ARGS__); FATAL_THROW(__VA_ARGS__)
 #define ERROR(...) FANCY_LOG(error, __VA_ARGS__); PrintStack()
+
+#if WIIGHT_LOG_LEVEL <= WIIGHT_LOG_WARN
 #define WARN(...)  FANCY_LOG(warn,  __VA_ARGS__)
+#else
+#define WARN(...)  NO_LOG(warn,  __VA_ARGS__)
+#endif
+
+#if WIIGHT_LOG_LEVEL <= WIIGHT_LOG_INFO
 #define INFO(...)  FANCY_LOG(info,  __VA_ARGS__)
+#else
+#define INFO(...)  NO_LOG(info,  __VA_ARGS__)
+#endif
+
+#if WIIGHT_LOG_LEVEL <= WIIGHT_LOG_DEBUG
 #define DEBUG(...) FANCY_LOG(debug, __VA_ARGS__)
+#else
+#define DEBUG(...) NO_LOG(debug, __VA_ARGS__)
+#endif
 
 #endif  // #ifndef  LOGGING_H_
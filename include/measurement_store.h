@@ -0,0 +1,93 @@
+#ifndef  MEASUREMENT_STORE_H_
+#define  MEASUREMENT_STORE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "calibration.h"
+
+// One weighing, as stored in the measurements table.
+struct Measurement
+{
+  uint64_t timestamp_us;
+  uint32_t device;
+  int64_t user_id;       // 0 until the reading is attributed to someone
+  double weight;
+  double stddev;
+  double confidence;
+  double cop_x;
+  double cop_y;
+  int32_t corners[4];    // Mean raw corners over the settled window
+  uint64_t calibration;  // Model version the weight was computed with
+};
+
+// Append-only measurement store fed through a queue by a background writer.
+// Rows are grouped into one transaction per batch, triggered by batch size or
+// age, using a prepared insert on the writer's own WAL-mode connection.
+// Producers only ever take a short lock to append to the queue, so they never
+// wait on SQLite or fsync.
+class MeasurementStore
+{
+public:
+  struct Options
+  {
+    size_t batch_size = 256;  // Commit as soon as this many rows are queued
+    int flush_ms = 1000;      // ...or at least this often while rows wait
+    size_t max_queue = 65536; // Rows beyond this are dropped, not blocked on
+  };
+
+  MeasurementStore( const std::string &path, const Options &options );
+  explicit MeasurementStore( const std::string &path );
+  ~MeasurementStore ();
+
+  // Queues a row.  Returns false (and counts a drop) if the queue is full.
+  bool Enqueue( const Measurement &measurement );
+
+  // Blocks until everything queued so far is committed.
+  void Flush ();
+
+  // Recomputes weight and center of pressure of every row stored from any of
+  // devices from its raw corners with model.  Returns the number of rows
+  // rewritten.
+  size_t Recalibrate( const std::vector<uint32_t> &devices,
+                      const CalibrationModel &model );
+
+  size_t QueueDepth () const;
+  uint64_t Committed () const { return committed_.load(); }
+  uint64_t Dropped () const { return dropped_.load(); }
+  uint64_t Batches () const { return batches_.load(); }
+
+  const std::string& Path () const { return path_; }
+
+private:
+  void Run ();
+
+  const std::string path_;
+  const Options options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable wake_writer_;
+  std::condition_variable flushed_;
+  std::vector<Measurement> queue_;
+  bool writing_;
+  bool flush_requested_;
+  bool should_stop_;
+
+  std::atomic<uint64_t> committed_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> batches_;
+
+  std::thread thread_;
+};
+
+// Opens a connection with the pragmas every wiight connection uses: WAL
+// journal, NORMAL sync (durable at checkpoints, never corrupt), a larger page
+// cache and a busy timeout so readers and the writer don't error on contention.
+sqlite::database OpenTunedDatabase( const std::string &path );
+
+#endif  // #ifndef  MEASUREMENT_STORE_H_
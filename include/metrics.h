@@ -0,0 +1,152 @@
+#ifndef  METRICS_H_
+#define  METRICS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <evhtp.h>
+
+// Nanoseconds on CLOCK_MONOTONIC.
+uint64_t MonotonicNanos ();
+
+// Thread index used to pick a metric's shard.  Each thread gets its own the
+// first time it records anything.
+size_t ThreadSlot ();
+
+static constexpr size_t METRIC_SHARDS = 64;
+
+// HDR-style latency histogram in nanoseconds.  Buckets are log-linear: 32
+// linear sub-buckets per power of two, so any value is placed within ~3% of
+// itself across the whole 64 bit range, in a fixed 15 KB per shard.
+//
+// Recording touches only the calling thread's shard, allocated on its first
+// record, with relaxed atomic adds on memory no other thread writes; readers
+// merge the shards.  No locks and no shared cache lines on the hot path.
+class Histogram
+{
+public:
+  static constexpr int SUB_BITS = 5;
+  static constexpr size_t SUB_BUCKETS = size_t( 1 ) << SUB_BITS;
+  static constexpr size_t BUCKETS = ( 64 - SUB_BITS + 1 ) * SUB_BUCKETS;
+
+  struct Snapshot
+  {
+    uint64_t counts[BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+
+    // Value at quantile q (0..1), as the upper bound of its bucket.
+    uint64_t Quantile( double q ) const;
+  };
+
+  Histogram ();
+  ~Histogram ();
+
+  Histogram ( const Histogram& ) = delete;
+  Histogram& operator= ( const Histogram& ) = delete;
+
+  void Record( uint64_t value );
+
+  // Merges every shard.  Concurrent records may or may not be included.
+  void Collect( Snapshot *snapshot ) const;
+
+  static size_t Bucket( uint64_t value );
+  static uint64_t UpperBound( size_t bucket );
+
+private:
+  struct Shard
+  {
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+  };
+
+  Shard* NewShard( size_t slot );
+
+  std::atomic<Shard*> shards_[METRIC_SHARDS];
+};
+
+// Monotonic counter, sharded by thread like Histogram.
+class Counter
+{
+public:
+  Counter ();
+
+  Counter ( const Counter& ) = delete;
+  Counter& operator= ( const Counter& ) = delete;
+
+  void Add( uint64_t n = 1 )
+  {
+    cells_[ ThreadSlot() % METRIC_SHARDS ].value.fetch_add(
+        n, std::memory_order_relaxed );
+  }
+
+  uint64_t Value () const;
+
+private:
+  struct alignas( 64 ) Cell
+  {
+    std::atomic<uint64_t> value;
+  };
+
+  Cell cells_[METRIC_SHARDS];
+};
+
+// Records the time from construction to destruction into a histogram.
+class ScopedTimer
+{
+public:
+  explicit ScopedTimer( Histogram &histogram )
+    : histogram_( histogram ), start_{ MonotonicNanos() }
+  {
+  }
+
+  ~ScopedTimer ()
+  {
+    histogram_.Record( MonotonicNanos() - start_ );
+  }
+
+private:
+  Histogram &histogram_;
+  const uint64_t start_;
+};
+
+// Every stage wiight measures.  Latencies are in nanoseconds and exported in
+// seconds.
+struct Metrics
+{
+  // Sensor path
+  Histogram xwii_dispatch;     // One XwiiSource::Read of a board
+  Histogram convert;           // ConvertBatch of one batch
+  Histogram settle;            // Settle detection over one batch
+  Histogram sway;              // Sway analysis over one batch
+  Histogram db_commit;         // One measurement store transaction
+  Histogram sample_to_client;  // Sample or settle event published to sent
+  Histogram sensor_to_client;  // Its board timestamp to sent, wall clock
+  Counter samples;
+  Counter stream_frames;
+  Counter db_rows;
+
+  // Request path
+  Histogram ws_send;           // One nn_sendmsg of an API reply
+  Histogram api_response;      // API request received to reply sent
+  Histogram http_request;      // RootCallback
+  Histogram export_batch;      // One batch of history export rows queued
+  Counter api_requests;
+  Counter http_requests;
+  Counter export_rows;
+
+  // Appends everything in Prometheus text exposition format.  Histograms are
+  // summaries with p50, p99 and p999 over the life of the process.
+  void Render( std::string *out ) const;
+
+  // evhtp handler for GET /metrics.  arg is the Metrics.
+  static void MetricsCallback( evhtp_request_t *req, void *arg );
+};
+
+// The process wide metrics.
+Metrics& GlobalMetrics ();
+
+#endif  // #ifndef  METRICS_H_
@@ -0,0 +1,87 @@
+#ifndef  ROLLUPS_H_
+#define  ROLLUPS_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <sqlite_modern_cpp.h>
+
+#include "measurement_store.h"
+
+// Pre-aggregated measurement statistics per user and time bucket.  Each tier
+// is its own table keyed on (user_id, bucket_us).
+struct RollupTier
+{
+  const char *name;
+  const char *table;
+  uint64_t bucket_us;
+};
+
+static constexpr size_t NUM_ROLLUP_TIERS = 3;
+extern const RollupTier ROLLUP_TIERS[NUM_ROLLUP_TIERS];
+
+// Count, extremes, mean and sum of squared deviations of a set of weights.
+// Merging two is exact (Chan et al.), which is what lets buckets be updated
+// a batch at a time.
+struct RollupStats
+{
+  uint64_t count = 0;
+  double min = 0;
+  double max = 0;
+  double mean = 0;
+  double m2 = 0;
+
+  void Add( double weight );
+  void Merge( const RollupStats &other );
+  double Variance () const { return count > 1 ? m2 / ( count - 1 ) : 0; }
+};
+
+void CreateRollupTables( sqlite::database &db );
+
+// Folds batches of new measurements into every tier.  Add() accumulates in
+// memory; Write() merges the touched buckets into the tables and must run
+// inside the same transaction that inserted the measurements.  Whatever was
+// accumulated is consumed by Write() even if it throws, so a rolled back
+// batch is never counted twice.
+class RollupWriter
+{
+public:
+  explicit RollupWriter( sqlite::database &db );
+
+  void Add( const Measurement &measurement );
+  void Write ();
+
+private:
+  typedef std::tuple<size_t, int64_t, uint64_t> BucketKey;
+
+  std::vector<sqlite::database_binder> select_;
+  std::vector<sqlite::database_binder> upsert_;
+  std::map<BucketKey, RollupStats> pending_;
+};
+
+// Recomputes every tier from the measurements table, e.g. after history was
+// recalibrated.
+void RebuildRollups( sqlite::database &db );
+
+struct HistoryPoint
+{
+  uint64_t timestamp_us;  // Bucket start, or the measurement time for raw
+  RollupStats stats;
+};
+
+// Returns the history of user between start_us and end_us in at most
+// max_points + 1 points (the first may start before start_us).  Spans under
+// max_points minutes that hold at most max_points measurements are returned
+// raw.  Otherwise the finest tier whose buckets are at least
+// (end_us - start_us) / max_points wide answers, with day buckets merged
+// further for very long spans, so the cost depends on the number of points
+// returned rather than stored.  Returns the tier name used.  Throws
+// std::invalid_argument unless end_us > start_us.
+std::string QueryHistory( sqlite::database &db, int64_t user_id,
+                          uint64_t start_us, uint64_t end_us,
+                          size_t max_points, std::vector<HistoryPoint> *out );
+
+#endif  // #ifndef  ROLLUPS_H_
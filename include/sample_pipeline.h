@@ -0,0 +1,141 @@
+#ifndef  SAMPLE_PIPELINE_H_
+#define  SAMPLE_PIPELINE_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <event2/event.h>
+
+#include "calibration.h"
+#include "convert.h"
+#include "measurement_store.h"
+#include "sample_ring.h"
+#include "sensor_reader.h"
+#include "sensor_source.h"
+#include "settle_detector.h"
+#include "sway_analyzer.h"
+
+// The live sample path, run from an event loop.  Samples are pushed into the
+// ring for other consumers (display, streaming), then converted, run through
+// a SettleDetector, and each settled weighing is queued on the store.  From
+// settling until stepping off, the center of pressure also feeds a
+// SwayAnalyzer whose window is handed out after every batch and whose
+// session summary is handed out at the end.
+//
+// Samples come either straight from a source read on the loop, with no
+// thread handoff, or from a SensorReader thread that fills the ring.  One
+// pipeline serves one board; when the board reconnects, its new source is
+// attached to the same pipeline.
+class SamplePipeline
+{
+public:
+  using EventHandler = std::function<void( const SettleEvent& )>;
+  using FinishHandler = std::function<void()>;
+  using BatchHandler =
+    std::function<void( const RawBatch&, const ConvertedBatch& )>;
+  using Identifier =
+    std::function<int64_t( uint64_t timestamp_us, double weight )>;
+  using SwayHandler = std::function<void( const SwayMetrics& )>;
+  using SessionHandler = std::function<void( const SwaySession& )>;
+
+  SamplePipeline( uint32_t device, const Calibrator &calibrator,
+                  MeasurementStore &store, SampleRing<RawSample> &ring,
+                  EventHandler on_event );
+  ~SamplePipeline ();
+
+  SamplePipeline ( const SamplePipeline& ) = delete;
+  SamplePipeline& operator= ( const SamplePipeline& ) = delete;
+
+  // Also hands every converted batch to handler, e.g. for streaming.
+  void OnBatch( BatchHandler handler ) { on_batch_ = std::move( handler ); }
+
+  // Settled weighings are attributed to the user identifier returns, 0 for
+  // nobody.
+  void Identify( Identifier identifier ) { identify_ = std::move( identifier ); }
+
+  // Sway of the current window, after each batch while someone stands on
+  // the board.
+  void OnSway( SwayHandler handler ) { on_sway_ = std::move( handler ); }
+
+  // Summary of each session, as its user steps off.
+  void OnSession( SessionHandler handler )
+  {
+    on_session_ = std::move( handler );
+  }
+
+  // Called once the source is exhausted or the board is gone.
+  void OnFinish( FinishHandler handler ) { on_finish_ = std::move( handler ); }
+
+  // Reads source on base's loop whenever its fd is readable, or on a short
+  // timer for sources without one.  Replaces any previous, finished source.
+  void ReadOnLoop( event_base *base, std::unique_ptr<SensorSource> source );
+
+  // Consumes what reader pushes into the ring, polling from base's loop.
+  void ConsumeOnLoop( event_base *base, const SensorReader &reader );
+
+  // True once the source is exhausted and every sample has been processed.
+  bool Finished () const { return finished_; }
+
+  uint64_t SamplesProcessed () const { return processed_; }
+
+  // Samples known lost: ring overruns, plus gaps in the source's timestamps
+  // longer than the sample period.
+  uint64_t Dropped () const { return dropped_ + cursor_.Overruns(); }
+
+  uint32_t Device () const { return device_; }
+
+private:
+  static void ReadableCallback( evutil_socket_t fd, short what, void *arg );
+  static void PollCallback( evutil_socket_t fd, short what, void *arg );
+
+  // Reads the source into the ring.  False once it is exhausted.
+  bool ReadSource ();
+  void Process ();
+  void Finish ();
+  void CountGap( uint64_t timestamp_us );
+  void TrackSway( const SettleEvent &event, int64_t user_id );
+
+  // A settle event of the batch being processed, at sample idx.
+  struct BatchEvent
+  {
+    size_t idx;
+    SettleEvent event;
+    int64_t user_id;
+  };
+
+  const uint32_t device_;
+  const Calibrator &calibrator_;
+  MeasurementStore &store_;
+  SampleRing<RawSample> &ring_;
+  SampleRing<RawSample>::Reader cursor_;
+  const EventHandler on_event_;
+  BatchHandler on_batch_;
+  Identifier identify_;
+  FinishHandler on_finish_;
+  SwayHandler on_sway_;
+  SessionHandler on_session_;
+
+  std::unique_ptr<SensorSource> source_;
+  const SensorReader *reader_;
+  event *event_;
+
+  SettleDetector detector_;
+  SwayAnalyzer sway_;
+  double sway_weight_;     // Settled weight of the session being analyzed
+  int64_t sway_user_;
+  std::vector<RawSample> recent_;
+  size_t recent_next_;
+  std::vector<RawSample> samples_;
+  std::vector<BatchEvent> batch_events_;
+  RawBatch raw_;
+  ConvertedBatch converted_;
+  uint64_t processed_;
+  uint64_t dropped_;
+  uint64_t last_us_;
+  uint64_t period_us_;     // Of the source, for CountGap
+  bool finished_;
+};
+
+#endif  // #ifndef  SAMPLE_PIPELINE_H_
@@ -0,0 +1,161 @@
+#ifndef  SAMPLE_RING_H_
+#define  SAMPLE_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+// Preallocated lock-free ring with a single producer.  The producer never
+// blocks and never waits on consumers: when the ring is full it overwrites the
+// oldest slot.  Each consumer reads through its own Reader cursor at its own
+// pace and counts the items it lost to being lapped.
+//
+// Slots are guarded by a sequence number (a per-slot seqlock) so a reader can
+// tell when the producer overwrote the slot it was copying.
+template <typename T>
+class SampleRing
+{
+  static_assert( std::is_trivially_copyable<T>::value,
+                 "SampleRing items are copied without locks" );
+
+  struct Slot
+  {
+    std::atomic<uint64_t> seq;
+    T value;
+  };
+
+public:
+  class Reader
+  {
+  public:
+    // Copies up to max items into out.  Returns the number copied.
+    size_t Read( T *out, size_t max )
+    {
+      size_t count = 0;
+      while( count < max )
+      {
+        uint64_t head = ring_->head_.load( std::memory_order_acquire );
+        if( cursor_ == head )
+        {
+          break;
+        }
+        if( head - cursor_ > ring_->capacity_ )
+        {
+          Skip( head - ring_->capacity_ );
+        }
+
+        const Slot &slot = ring_->slots_[ cursor_ & ring_->mask_ ];
+        uint64_t expected = 2*cursor_ + 2;
+        uint64_t before = slot.seq.load( std::memory_order_acquire );
+        out[count] = slot.value;
+        std::atomic_thread_fence( std::memory_order_acquire );
+        uint64_t after = slot.seq.load( std::memory_order_relaxed );
+        if( before != expected || after != expected )
+        {
+          // Lapped while copying, jump to the oldest item still in the ring
+          Skip( ring_->head_.load( std::memory_order_acquire ) -
+                ring_->capacity_ + 1 );
+          continue;
+        }
+
+        ++cursor_;
+        ++count;
+      }
+      return count;
+    }
+
+    // Number of items available right now.
+    size_t Available () const
+    {
+      uint64_t head = ring_->head_.load( std::memory_order_acquire );
+      uint64_t backlog = head - cursor_;
+      return backlog > ring_->capacity_ ? ring_->capacity_ : backlog;
+    }
+
+    uint64_t Overruns () const { return overruns_; }
+
+  private:
+    friend class SampleRing;
+
+    Reader ( const SampleRing *ring, uint64_t cursor )
+      : ring_{ ring }, cursor_{ cursor }, overruns_{ 0 }
+    {}
+
+    void Skip( uint64_t to )
+    {
+      if( to > cursor_ )
+      {
+        overruns_ += to - cursor_;
+        cursor_ = to;
+      }
+    }
+
+    const SampleRing *ring_;
+    uint64_t cursor_;
+    uint64_t overruns_;
+  };
+
+  // Capacity is rounded up to a power of two.
+  explicit SampleRing ( size_t capacity )
+    : capacity_{ RoundUp( capacity ) }, mask_{ capacity_ - 1 },
+      slots_{ new Slot[ capacity_ ] }, head_{ 0 }
+  {
+    for( size_t idx=0; idx < capacity_; ++idx )
+    {
+      slots_[idx].seq.store( 0, std::memory_order_relaxed );
+    }
+  }
+
+  SampleRing ( const SampleRing& ) = delete;
+  SampleRing& operator= ( const SampleRing& ) = delete;
+
+  // Producer only.
+  void Push( const T &item )
+  {
+    uint64_t pos = head_.load( std::memory_order_relaxed );
+    Slot &slot = slots_[ pos & mask_ ];
+    slot.seq.store( 2*pos + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    slot.value = item;
+    slot.seq.store( 2*pos + 2, std::memory_order_release );
+    head_.store( pos + 1, std::memory_order_release );
+  }
+
+  // A cursor that starts with the next item pushed.
+  Reader NewReader () const
+  {
+    return Reader( this, head_.load( std::memory_order_acquire ));
+  }
+
+  // Total number of items ever pushed.
+  uint64_t Written () const { return head_.load( std::memory_order_acquire ); }
+
+  size_t Capacity () const { return capacity_; }
+
+private:
+  static size_t RoundUp( size_t capacity )
+  {
+    if( capacity == 0 )
+    {
+      throw std::invalid_argument( "SampleRing capacity must be non-zero" );
+    }
+    size_t rounded = 1;
+    while( rounded < capacity )
+    {
+      rounded <<= 1;
+    }
+    return rounded;
+  }
+
+  const size_t capacity_;
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  // Keeps the producer's stores to head_ off the line readers keep loading
+  char padding_[64] __attribute__(( unused ));
+  std::atomic<uint64_t> head_;
+};
+
+#endif  // #ifndef  SAMPLE_RING_H_
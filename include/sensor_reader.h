@@ -0,0 +1,44 @@
+#ifndef  SENSOR_READER_H_
+#define  SENSOR_READER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "sample_ring.h"
+#include "sensor_source.h"
+
+// Owns the sensor hot path: a dedicated thread that does nothing but drain a
+// SensorSource into a SampleRing.  Conversion, display, storage and fan-out
+// all happen on the consumer side of the ring.
+class SensorReader
+{
+public:
+  SensorReader( std::unique_ptr<SensorSource> source,
+                SampleRing<RawSample> &ring );
+  ~SensorReader ();
+
+  // Starts the reader thread, pinned to cpu unless cpu is negative.
+  void Start( int cpu );
+  void Stop ();
+
+  // True once the source is exhausted and everything has been pushed.
+  bool Finished () const { return finished_.load(); }
+
+  uint64_t SamplesRead () const { return samples_read_.load(); }
+
+  uint64_t PeriodMicros () const { return source_->PeriodMicros(); }
+
+private:
+  void Run ();
+
+  std::unique_ptr<SensorSource> source_;
+  SampleRing<RawSample> &ring_;
+  std::thread thread_;
+  std::atomic<bool> should_stop_;
+  std::atomic<bool> finished_;
+  std::atomic<uint64_t> samples_read_;
+};
+
+#endif  // #ifndef  SENSOR_READER_H_
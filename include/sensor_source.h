@@ -0,0 +1,150 @@
+#ifndef  SENSOR_SOURCE_H_
+#define  SENSOR_SOURCE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+struct xwii_iface;
+
+// One balance board reading.  Corners are the raw event.v.abs[0..3].x values
+// in units of 10 g, in xwiimote order (TR, BL, TL, BR).
+struct RawSample
+{
+  uint64_t timestamp_us;
+  int32_t corners[4];
+};
+static_assert( sizeof( RawSample ) == 24, "RawSample is a fixed log record" );
+
+// Anything that produces RawSamples: a live board, a log being replayed, or a
+// source being recorded.
+class SensorSource
+{
+public:
+  virtual ~SensorSource () = default;
+
+  // Descriptor to poll for readability, or -1 if the source is timer driven.
+  virtual int Fd () const = 0;
+
+  // Reads up to max samples without blocking.  Returns the number read (which
+  // may be 0), or -1 once the source is exhausted or the device is gone.
+  virtual int Read( RawSample *out, int max ) = 0;
+
+  // Blocks for up to timeout_ms (-1 forever) until Read() has something.
+  virtual void Wait( int timeout_ms );
+
+  // Microseconds between samples, by which gaps in their timestamps are
+  // judged.  The board's 10 ms unless the source says otherwise.
+  virtual uint64_t PeriodMicros () const;
+};
+
+// Live xwiimote balance board.  Takes ownership of an iface that has already
+// been opened with XWII_IFACE_BALANCE_BOARD.
+class XwiiSource : public SensorSource
+{
+public:
+  explicit XwiiSource( ::xwii_iface *iface );
+  ~XwiiSource () override;
+
+  int Fd () const override;
+  int Read( RawSample *out, int max ) override;
+
+private:
+  ::xwii_iface *iface_;
+};
+
+// Fixed-record binary log of RawSamples.  A 32 byte header followed by
+// RawSample records, so a log can be mmapped and indexed directly.
+struct SampleLogHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t start_us;   // WallMicros() when the log was created
+  uint64_t reserved;
+};
+static_assert( sizeof( SampleLogHeader ) == 32, "Log header is 32 bytes" );
+
+// Passes samples through from another source while appending them to a log.
+class RecordingSource : public SensorSource
+{
+public:
+  RecordingSource( std::unique_ptr<SensorSource> inner, const std::string &path );
+  ~RecordingSource () override;
+
+  int Fd () const override;
+  int Read( RawSample *out, int max ) override;
+  void Wait( int timeout_ms ) override;
+  uint64_t PeriodMicros () const override;
+
+private:
+  std::unique_ptr<SensorSource> inner_;
+  FILE *log_;
+};
+
+// Plays a log back from a read-only mapping.  A speed of 1.0 replays in real
+// time, 10.0 ten times faster, and 0 as fast as the consumer reads.
+class ReplaySource : public SensorSource
+{
+public:
+  ReplaySource( const std::string &path, double speed );
+  ~ReplaySource () override;
+
+  int Fd () const override;
+  int Read( RawSample *out, int max ) override;
+  void Wait( int timeout_ms ) override;
+
+  size_t Size () const { return num_records_; }
+
+private:
+  // Wall clock microsecond at which record idx is due.
+  uint64_t DueAt( size_t idx ) const;
+
+  void *map_;
+  size_t map_size_;
+  const RawSample *records_;
+  size_t num_records_;
+  size_t next_;
+  double speed_;
+  uint64_t wall_start_us_;
+};
+
+// A made-up balance board for load testing without hardware.  Someone of a
+// board specific weight steps on, sways about, stands still long enough to
+// settle, and steps off again, every 23 s.  Samples are produced at rate_hz
+// on the wall clock, or as fast as they are read if rate_hz is 0, and stop
+// after count of them unless count is 0.  Like the board's, their
+// timestamps are on the system clock, starting from when the source was made.
+class SimulatedSource : public SensorSource
+{
+public:
+  SimulatedSource( uint32_t board, double rate_hz, uint64_t count = 0 );
+
+  int Fd () const override;
+  int Read( RawSample *out, int max ) override;
+  void Wait( int timeout_ms ) override;
+  uint64_t PeriodMicros () const override { return period_us_; }
+
+private:
+  void Generate( uint64_t idx, RawSample *out );
+
+  const double weight_;     // Pounds
+  const uint64_t phase_;    // Samples into the cycle the board starts at
+  const double rate_hz_;
+  const uint64_t count_;
+  const uint64_t period_us_;
+  uint64_t start_us_;       // MonotonicMicros(), for pacing
+  uint64_t epoch_us_;       // WallMicros(), for timestamps
+  uint64_t next_;
+  uint64_t noise_;          // xorshift state
+};
+
+// Microseconds on CLOCK_MONOTONIC.
+uint64_t MonotonicMicros ();
+
+// Microseconds since the epoch on CLOCK_REALTIME, the clock of the board's
+// event timestamps.
+uint64_t WallMicros ();
+
+#endif  // #ifndef  SENSOR_SOURCE_H_
@@ -0,0 +1,69 @@
+#ifndef  SETTLE_DETECTOR_H_
+#define  SETTLE_DETECTOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct SettleEvent
+{
+  enum Type { STEP_ON, SETTLED, STEP_OFF };
+
+  Type type;
+  uint64_t timestamp_us;
+  double weight;      // Settled mean, or the filtered weight for step on/off
+  double stddev;      // Spread of the window the weight was taken from
+  double confidence;  // 0 (barely settled) to 1 (perfectly still)
+};
+
+const char* SettleEventName( SettleEvent::Type type );
+
+struct SettleConfig
+{
+  double step_on_weight = 10.0;  // Filtered weight that counts as stepping on
+  double step_off_weight = 5.0;  // ...and as stepping off again
+  size_t window = 50;            // Samples of running stats, ~0.5 s at 100 Hz
+  size_t median = 5;             // Spike filter length, odd
+  double settle_stddev = 0.3;    // Window spread under which weight is stable
+};
+
+// Incremental weighing detector for the live sample stream.  Every sample
+// costs O(1): a short median filter knocks out spikes, then a Welford
+// mean/variance is kept over a sliding window by adding the new sample and
+// removing the one that fell out of the window.
+class SettleDetector
+{
+public:
+  explicit SettleDetector( const SettleConfig &config = SettleConfig() );
+
+  // Feeds one calibrated weight.  Returns true if it produced an event.
+  bool Add( uint64_t timestamp_us, double weight, SettleEvent *event );
+
+  double Mean () const { return mean_; }
+  double StdDev () const;
+  bool Loaded () const { return state_ != State::EMPTY; }
+
+private:
+  enum class State { EMPTY, LOADING, SETTLED };
+
+  double MedianFilter( double weight );
+  void Push( double weight );
+  void ResetWindow ();
+
+  SettleConfig config_;
+  State state_;
+
+  std::vector<double> median_buf_;
+  size_t median_next_;
+  size_t median_count_;
+
+  std::vector<double> window_;
+  size_t window_next_;
+  size_t count_;
+  double mean_;
+  double m2_;
+
+  SettleEvent settled_;
+};
+
+#endif  // #ifndef  SETTLE_DETECTOR_H_
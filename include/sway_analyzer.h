@@ -0,0 +1,152 @@
+#ifndef  SWAY_ANALYZER_H_
+#define  SWAY_ANALYZER_H_
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <sqlite_modern_cpp.h>
+
+#include "thread_pool.h"
+
+// Spectrum bins kept by the sliding DFT, bin k at k / window seconds.  With
+// the default 1024 sample window at 100 Hz they cover 0.1 to 2 Hz, where
+// postural sway lives.
+static constexpr size_t SWAY_BINS = 20;
+
+// Sway over the current window, all distances in mm on the board.
+struct SwayMetrics
+{
+  uint64_t timestamp_us;   // Newest sample
+  uint32_t samples;        // In the window
+  double cop_x;            // Newest center of pressure
+  double cop_y;
+  double path_length;      // Distance the center of pressure travelled
+  double mean_velocity;    // ...over the window's duration, mm/s
+  double rms;              // Radial RMS distance from the window's mean
+  double rms_x;            // ...side to side
+  double rms_y;            // ...front to back
+  double ellipse_area;     // 95% confidence ellipse, mm^2
+  double mean_frequency;   // Power weighted mean of the spectrum, Hz
+  double bin_hz;           // Width of a spectrum bin
+  double spectrum_x[SWAY_BINS];  // Amplitude in mm of bins 1..SWAY_BINS,
+  double spectrum_y[SWAY_BINS];  // zero until the window has filled
+};
+
+// Summary of one session on the board, from settling to stepping off.
+struct SwaySession
+{
+  int64_t id = 0;          // Row id once stored
+  uint32_t device = 0;
+  int64_t user_id = 0;
+  uint64_t start_us = 0;
+  uint64_t end_us = 0;
+  uint64_t samples = 0;
+  double weight = 0;       // Settled weight
+  double path_length = 0;  // Over the whole session
+  double mean_velocity = 0;
+  double rms = 0;          // About the session's mean position
+  double ellipse_area = 0;
+  double mean_frequency = 0;  // Mean over the full windows, 0 if none filled
+};
+
+struct SwayConfig
+{
+  size_t window = 1024;       // Samples, ~10 s at 100 Hz, over 2 * SWAY_BINS
+  double sample_rate = 100;   // Nominal Hz, for velocity and bin spacing
+};
+
+// Incremental center of pressure sway analysis for one board.
+//
+// Each sample costs O(SWAY_BINS), independent of the window length: running
+// sums of x, y, x^2, y^2 and xy give the RMS and ellipse, a ring of step
+// lengths gives the path, and a sliding DFT shifts each bin by one sample
+// (add the new sample, drop the oldest, rotate).  Sliding sums and the DFT's
+// rotations accumulate rounding, so everything is recomputed exactly from the
+// window once per window's worth of samples, which is O(1) amortized.
+// Coordinates are kept relative to the session's first sample so the sums
+// stay well conditioned.
+class SwayAnalyzer
+{
+public:
+  explicit SwayAnalyzer( const SwayConfig &config = SwayConfig() );
+
+  // Starts a session: empty window and summary.
+  void Begin( uint64_t timestamp_us, double weight );
+
+  // Adds a center of pressure sample to the running session.
+  void Add( uint64_t timestamp_us, double cop_x, double cop_y );
+
+  bool Active () const { return active_; }
+
+  // The current window.  O(SWAY_BINS).
+  void Window( SwayMetrics *out ) const;
+
+  // Ends the session, summarizing it.
+  void End( uint64_t timestamp_us, SwaySession *out );
+
+private:
+  void Resync ();
+  double MeanFrequency () const;
+
+  const SwayConfig config_;
+  bool active_;
+
+  // Window of positions relative to origin, unfilled slots are zero
+  std::vector<double> xs_;
+  std::vector<double> ys_;
+  std::vector<double> steps_;   // Distance from the previous sample
+  size_t next_;
+  size_t count_;
+  size_t since_resync_;
+  double origin_x_;
+  double origin_y_;
+  uint64_t last_us_;
+
+  double sum_x_;
+  double sum_y_;
+  double sum_xx_;
+  double sum_yy_;
+  double sum_xy_;
+  double sum_steps_;
+
+  // twiddles_[i] = exp( -2 pi j i / window )
+  std::vector<std::complex<double>> twiddles_;
+  std::complex<double> dft_x_[SWAY_BINS];
+  std::complex<double> dft_y_[SWAY_BINS];
+
+  // Whole session
+  SwaySession session_;
+  double total_x_;
+  double total_y_;
+  double total_xx_;
+  double total_yy_;
+  double total_xy_;
+  double frequency_sum_;
+  uint64_t frequency_windows_;
+};
+
+// Session summaries in the sway_sessions table.  The table is made on db;
+// sessions are stored from the pool so the INSERT never blocks the loop.
+// Loop thread only.
+class SwaySessionLog
+{
+public:
+  SwaySessionLog( sqlite::database &db, ThreadPool &pool );
+
+  // Queues session to be stored.
+  void Add( const SwaySession &session );
+
+private:
+  ThreadPool &pool_;
+};
+
+// Sessions of user_id (any user if negative) that started in
+// [start_us, end_us], newest first, at most limit of them.
+std::vector<SwaySession> QuerySwaySessions( sqlite::database &db,
+                                            int64_t user_id,
+                                            uint64_t start_us,
+                                            uint64_t end_us, size_t limit );
+
+#endif  // #ifndef  SWAY_ANALYZER_H_
@@ -0,0 +1,60 @@
+#ifndef  THREAD_POOL_H_
+#define  THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <event2/event.h>
+#include <sqlite_modern_cpp.h>
+
+// A few worker threads for work too slow for the event loop, such as history
+// queries, recalibration and storing sway sessions.  Work runs on a worker
+// with that worker's own SQLite connection; its completion runs back on the
+// loop's thread, so completions can touch loop state without locking.
+//
+// The base must be thread aware (HttpServer makes libevent so).
+class ThreadPool
+{
+public:
+  using Work = std::function<void( sqlite::database &db )>;
+  using Done = std::function<void()>;
+
+  ThreadPool( event_base *base, int threads, const std::string &database );
+  ~ThreadPool ();
+
+  ThreadPool ( const ThreadPool& ) = delete;
+  ThreadPool& operator= ( const ThreadPool& ) = delete;
+
+  // Queues work, then done on the loop once work has returned.
+  void Submit( Work work, Done done );
+
+  // Tasks queued or running.
+  size_t Pending () const;
+
+private:
+  struct Task
+  {
+    Work work;
+    Done done;
+  };
+
+  void Run ();
+  static void CompletedCallback( evutil_socket_t fd, short what, void *arg );
+
+  const std::string database_;
+  event *completed_;
+  mutable std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<Task> tasks_;
+  std::deque<Done> completions_;
+  size_t running_;
+  bool should_stop_;
+  std::vector<std::thread> threads_;
+};
+
+#endif  // #ifndef  THREAD_POOL_H_
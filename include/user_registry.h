@@ -0,0 +1,96 @@
+#ifndef  USER_REGISTRY_H_
+#define  USER_REGISTRY_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sqlite_modern_cpp.h>
+
+struct User
+{
+  int64_t id = 0;
+  std::string name;
+  int age = 0;
+  double weight = 0;  // Reference weight given when the user was set up
+};
+
+// The people who use the board, persisted in a users table and mirrored in
+// memory.  Changes are written through to SQLite before the index is touched.
+//
+// Each user carries a weight trend: a Holt (level and slope) smoother over
+// their attributed weighings, seeded from their recent measurements at
+// startup.  Users are also kept in a map sorted by trend level, so a settled
+// weight is attributed by looking only at users whose level is within
+// tolerance of it, instead of scanning everyone.
+//
+// Not thread safe, use it from the loop.
+class UserRegistry
+{
+public:
+  struct Options
+  {
+    double tolerance = 8;        // Pounds from a trend to count as a match
+    double level_gain = 0.3;     // Smoothing of the trend level
+    double slope_gain = 0.1;     // ...and of its slope
+    double max_slope = 0.5;      // Pounds per day a trend may move
+    double max_trend_days = 14;  // Slope isn't extrapolated further than this
+    size_t seed_history = 10;    // Measurements replayed per user at startup
+  };
+
+  UserRegistry( sqlite::database &db, const Options &options );
+  explicit UserRegistry( sqlite::database &db );
+
+  UserRegistry ( const UserRegistry& ) = delete;
+  UserRegistry& operator= ( const UserRegistry& ) = delete;
+
+  // Returns the new user's id.
+  int64_t Add( const std::string &name, int age, double weight );
+
+  // Replaces the stored fields of user.id.  A changed reference weight
+  // restarts the trend from it.  False if there is no such user.
+  bool Update( const User &user );
+
+  bool Remove( int64_t id );
+
+  // nullptr if there is no such user.
+  const User* Find( int64_t id ) const;
+
+  // Every user, by id.
+  std::vector<User> All () const;
+
+  size_t Size () const { return users_.size(); }
+
+  // The weight user id is expected to weigh at timestamp_us.
+  double Expected( int64_t id, uint64_t timestamp_us ) const;
+
+  // Picks the user whose trend best predicts weight, and folds the weighing
+  // into that user's trend.  Returns 0 if nobody is within tolerance.
+  int64_t Attribute( uint64_t timestamp_us, double weight );
+
+private:
+  using LevelIndex = std::multimap<double, int64_t>;
+
+  struct Entry
+  {
+    User user;
+    double level;
+    double slope;           // Pounds per day
+    uint64_t last_us;       // Time of the last weighing, 0 if none yet
+    LevelIndex::iterator indexed;
+  };
+
+  void Load ();
+  double Predict( const Entry &entry, uint64_t timestamp_us ) const;
+  void Observe( Entry *entry, uint64_t timestamp_us, double weight );
+  void Reindex( Entry *entry );
+
+  const Options options_;
+  sqlite::database &db_;
+  std::unordered_map<int64_t, Entry> users_;
+  LevelIndex by_level_;
+};
+
+#endif  // #ifndef  USER_REGISTRY_H_
@@ -0,0 +1,162 @@
+#include <cctype>
+#include <memory>
+
+#include "api_dispatcher.h"
+#include "logging.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+ApiDispatcher::ApiDispatcher( ThreadPool &pool )
+  : pool_( pool ), handled_{ 0 }, failed_{ 0 }
+{
+}
+
+void ApiDispatcher::On( const string &request, Handler handler )
+{
+  routes_[request] = Route{ move( handler ), nullptr };
+}
+
+void ApiDispatcher::OnPool( const string &request, PoolHandler handler )
+{
+  routes_[request] = Route{ nullptr, move( handler ) };
+}
+
+json ApiDispatcher::ErrorResponse( const string &what )
+{
+  json r;
+  r["response"] = "error";
+  r["error"] = what;
+  return r;
+}
+
+Encoding ApiDispatcher::Detect( const string &message )
+{
+  for( unsigned char c : message )
+  {
+    if( isspace( c ))
+    {
+      continue;
+    }
+    if( ( c >= 0xa0 && c <= 0xbb ) || c == 0xbf )
+    {
+      return Encoding::CBOR;
+    }
+    if( ( c >= 0x80 && c <= 0x8f ) || c == 0xde || c == 0xdf )
+    {
+      return Encoding::MSGPACK;
+    }
+    break;
+  }
+  return Encoding::JSON;
+}
+
+json ApiDispatcher::Decode( const string &message, Encoding encoding )
+{
+  switch( encoding )
+  {
+    case Encoding::CBOR:
+      return json::from_cbor( message.begin(), message.end() );
+    case Encoding::MSGPACK:
+      return json::from_msgpack( message.begin(), message.end() );
+    default:
+      // Clients send C strings, the terminator isn't part of the text
+      return json::parse( message.c_str() );
+  }
+}
+
+string ApiDispatcher::Encode( const json &message, Encoding encoding )
+{
+  string encoded;
+  switch( encoding )
+  {
+    case Encoding::CBOR:
+      json::to_cbor( message, encoded );
+      break;
+    case Encoding::MSGPACK:
+      json::to_msgpack( message, encoded );
+      break;
+    default:
+      encoded = message.dump();
+      // Replies go out NUL terminated, as the clients expect C strings
+      encoded.push_back( '\0' );
+      break;
+  }
+  return encoded;
+}
+
+Encoding ApiDispatcher::ReplyEncoding( const json &request, Encoding fallback )
+{
+  auto name = request.find( "encoding" );
+  if( name == request.end() || !name->is_string() )
+  {
+    return fallback;
+  }
+  if( *name == "cbor" )
+  {
+    return Encoding::CBOR;
+  }
+  if( *name == "msgpack" )
+  {
+    return Encoding::MSGPACK;
+  }
+  if( *name == "json" )
+  {
+    return Encoding::JSON;
+  }
+  throw runtime_error( "unknown encoding '" + name->get<string>() + "'" );
+}
+
+void ApiDispatcher::Dispatch( const string &message, Reply reply )
+{
+  json r;
+  Encoding encoding = Detect( message );
+  try
+  {
+    auto j = Decode( message, encoding );
+    encoding = ReplyEncoding( j, encoding );
+    string request = j.at( "request" );
+    auto route = routes_.find( request );
+    if( route == routes_.end() )
+    {
+      throw runtime_error( "unknown request '" + request + "'" );
+    }
+
+    if( route->second.pool_handler )
+    {
+      // The worker fills in the response, the loop sends it
+      auto response = make_shared<json>();
+      auto failed = make_shared<bool>( false );
+      PoolHandler &handler = route->second.pool_handler;
+      pool_.Submit( [&handler, j, response, failed]( sqlite::database &db ) {
+          try
+          {
+            *response = handler( j, db );
+          }
+          catch( const exception &e )
+          {
+            WARN( "Request '{}' failed: {}", j.dump(), e.what() );
+            *response = ErrorResponse( e.what() );
+            *failed = true;
+          }
+        },
+        [this, reply, response, failed, encoding]() {
+          ++handled_;
+          failed_ += *failed;
+          reply( Encode( *response, encoding ));
+        });
+      return;
+    }
+
+    r = route->second.handler( j );
+  }
+  catch( const exception &e )
+  {
+    WARN( "Bad {} byte request: {}", message.size(), e.what() );
+    r = ErrorResponse( e.what() );
+    ++failed_;
+  }
+
+  ++handled_;
+  reply( Encode( r, encoding ));
+}
@@ -0,0 +1,184 @@
+#include <cerrno>
+
+#include <nanomsg/nn.h>
+#include <nanomsg/reqrep.h>
+#include <nanomsg/ws.h>
+
+#include "api_socket.h"
+#include "logging.h"
+#include "metrics.h"
+
+using namespace std;
+
+// The descriptors nanomsg exposes for polling
+static int PollFd( int socket, int option )
+{
+  int fd = -1;
+  size_t size = sizeof( fd );
+  if( nn_getsockopt( socket, NN_SOL_SOCKET, option, &fd, &size ) < 0 )
+  {
+    FATAL( "Cannot get nanomsg poll fd: {}", nn_strerror( nn_errno() ));
+  }
+  return fd;
+}
+
+ApiSocket::ApiSocket( event_base *base, const string &url, Handler handler,
+                      size_t max_in_flight )
+  : handler_( move( handler )), max_in_flight_{ max_in_flight },
+    socket_{ -1 }, readable_{ nullptr }, writable_{ nullptr },
+    receiving_{ true }, next_id_{ 0 }
+{
+  // Raw, so the REP state machine doesn't hold us to one request at a time
+  socket_ = nn_socket( AF_SP_RAW, NN_REP );
+  if( socket_ < 0 )
+  {
+    FATAL( "nn_socket failed: {}", nn_strerror( nn_errno() ));
+  }
+  //int opt = NN_WS_MSG_TYPE_TEXT;
+  //nn_setsockopt( socket_, NN_WS, NN_WS_MSG_TYPE, &opt, sizeof(opt) );
+  if( nn_bind( socket_, url.c_str() ) < 0 )
+  {
+    int err = nn_errno();
+    nn_close( socket_ );
+    FATAL( "nn_bind to {} failed: {}", url, nn_strerror( err ));
+  }
+
+  readable_ = event_new( base, PollFd( socket_, NN_RCVFD ),
+                         EV_READ | EV_PERSIST, ReadableCallback, this );
+  writable_ = event_new( base, PollFd( socket_, NN_SNDFD ),
+                         EV_READ | EV_PERSIST, WritableCallback, this );
+  event_add( readable_, nullptr );
+
+  INFO( "Started NN WebSocket on {}", url );
+}
+
+ApiSocket::~ApiSocket ()
+{
+  event_free( readable_ );
+  event_free( writable_ );
+  for( auto &header : headers_ )
+  {
+    nn_freemsg( header.second.header );
+  }
+  for( auto &unsent : unsent_ )
+  {
+    nn_freemsg( unsent.pending.header );
+  }
+  nn_close( socket_ );
+}
+
+void ApiSocket::Reply( uint64_t id, const string &reply )
+{
+  auto header = headers_.find( id );
+  if( header == headers_.end() )
+  {
+    WARN( "Dropping reply to unknown request {}", id );
+    return;
+  }
+
+  unsent_.push_back( Unsent{ header->second, reply } );
+  headers_.erase( header );
+  if( unsent_.size() == 1 )
+  {
+    Send();
+  }
+}
+
+void ApiSocket::Send ()
+{
+  Metrics &metrics = GlobalMetrics();
+  while( !unsent_.empty() )
+  {
+    Unsent &unsent = unsent_.front();
+    nn_iovec iov = { &unsent.body[0], unsent.body.size() };
+    nn_msghdr hdr;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = &unsent.pending.header;
+    hdr.msg_controllen = NN_MSG;
+
+    // On success nanomsg takes the header
+    uint64_t start = MonotonicNanos();
+    int bytes = nn_sendmsg( socket_, &hdr, NN_DONTWAIT );
+    uint64_t end = MonotonicNanos();
+    metrics.ws_send.Record( end - start );
+    if( bytes < 0 && nn_errno() == EAGAIN )
+    {
+      event_add( writable_, nullptr );
+      return;
+    }
+
+    if( bytes < 0 )
+    {
+      WARN( "nn_sendmsg??: {}", nn_strerror( nn_errno() ));
+      nn_freemsg( unsent.pending.header );
+    }
+    else
+    {
+      DEBUG( "Sent {} byte reply", bytes );
+      metrics.api_response.Record( end - unsent.pending.received_ns );
+    }
+    unsent_.pop_front();
+  }
+  event_del( writable_ );
+
+  // A reply frees a slot, pick up requests left waiting from the loop
+  if( !receiving_ && headers_.size() < max_in_flight_ )
+  {
+    receiving_ = true;
+    event_add( readable_, nullptr );
+    event_active( readable_, EV_READ, 0 );
+  }
+}
+
+void ApiSocket::Receive ()
+{
+  while( headers_.size() < max_in_flight_ )
+  {
+    char *body = nullptr;
+    void *header = nullptr;
+    nn_iovec iov = { &body, NN_MSG };
+    nn_msghdr hdr;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = &header;
+    hdr.msg_controllen = NN_MSG;
+
+    int bytes = nn_recvmsg( socket_, &hdr, NN_DONTWAIT );
+    if( bytes < 0 )
+    {
+      if( nn_errno() != EAGAIN )
+      {
+        WARN( "nn_recvmsg??: {}", nn_strerror( nn_errno() ));
+      }
+      return;
+    }
+
+    uint64_t received_ns = MonotonicNanos();
+    string request( body, bytes );
+    nn_freemsg( body );
+
+    uint64_t id = next_id_++;
+    headers_[id] = Pending{ header, received_ns };
+    GlobalMetrics().api_requests.Add();
+    handler_( id, request );
+  }
+
+  // Full, stop reading until replies make room
+  receiving_ = false;
+  event_del( readable_ );
+}
+
+void ApiSocket::ReadableCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  static_cast<ApiSocket*>( arg )->Receive();
+}
+
+void ApiSocket::WritableCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  static_cast<ApiSocket*>( arg )->Send();
+}
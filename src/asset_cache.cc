@@ -0,0 +1,311 @@
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <pystring.h>
+#include <zlib.h>
+
+#include "asset_cache.h"
+#include "logging.h"
+
+using namespace std;
+
+// Files smaller than this aren't worth a gzip variant
+static constexpr size_t MIN_GZIP_SIZE = 256;
+
+const char* MimeType( const string &path )
+{
+  static const unordered_map<string, const char*> types = {
+    { ".html", "text/html; charset=utf-8" },
+    { ".htm",  "text/html; charset=utf-8" },
+    { ".js",   "application/javascript; charset=utf-8" },
+    { ".css",  "text/css; charset=utf-8" },
+    { ".json", "application/json" },
+    { ".map",  "application/json" },
+    { ".txt",  "text/plain; charset=utf-8" },
+    { ".svg",  "image/svg+xml" },
+    { ".png",  "image/png" },
+    { ".jpg",  "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".gif",  "image/gif" },
+    { ".ico",  "image/x-icon" },
+  };
+
+  string root, ext;
+  pystring::os::path::splitext( root, ext, path );
+  auto type = types.find( pystring::lower( ext ));
+  return type != types.end() ? type->second : "application/octet-stream";
+}
+
+// The q-value of one comma separated Accept-Encoding entry, 1 if it has
+// none, and its coding in *name.
+static double CodingWeight( const string &entry, string *name )
+{
+  vector<string> parts;
+  pystring::split( entry, parts, ";" );
+  *name = pystring::lower( pystring::strip( parts[0] ));
+  double q = 1;
+  for( size_t idx=1; idx < parts.size(); ++idx )
+  {
+    string param = pystring::lower( pystring::strip( parts[idx] ));
+    if( pystring::startswith( param, "q=" ))
+    {
+      q = atof( param.c_str() + 2 );
+    }
+  }
+  return q;
+}
+
+bool AcceptsGzip( const string &accept_encoding )
+{
+  double gzip_q = -1;
+  double any_q = -1;
+  vector<string> entries;
+  pystring::split( accept_encoding, entries, "," );
+  for( const string &entry : entries )
+  {
+    string name;
+    double q = CodingWeight( entry, &name );
+    if( name == "gzip" || name == "x-gzip" )
+    {
+      gzip_q = q;
+    }
+    else if( name == "*" )
+    {
+      any_q = q;
+    }
+  }
+  return gzip_q >= 0 ? gzip_q > 0 : any_q > 0;
+}
+
+bool EtagMatches( const string &if_none_match, const string &etag )
+{
+  if( pystring::strip( if_none_match ) == "*" )
+  {
+    return true;
+  }
+  vector<string> tags;
+  pystring::split( if_none_match, tags, "," );
+  for( const string &entry : tags )
+  {
+    string tag = pystring::strip( entry );
+    if( pystring::startswith( tag, "W/" ))
+    {
+      tag = tag.substr( 2 );
+    }
+    if( tag == etag )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 64 bit FNV-1a, plenty for telling versions of one file apart.
+static uint64_t ContentHash( const char *data, size_t size )
+{
+  uint64_t hash = 14695981039346656037ull;
+  for( size_t idx=0; idx < size; ++idx )
+  {
+    hash ^= uint8_t( data[idx] );
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static string Gzip( const char *data, size_t size )
+{
+  z_stream stream;
+  memset( &stream, 0, sizeof( stream ));
+  // 15 window bits + 16 selects the gzip wrapper rather than zlib's
+  if( deflateInit2( &stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                    Z_DEFAULT_STRATEGY ) != Z_OK )
+  {
+    return "";
+  }
+
+  string out( deflateBound( &stream, size ), '\0' );
+  stream.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( data ));
+  stream.avail_in = size;
+  stream.next_out = reinterpret_cast<Bytef*>( &out[0] );
+  stream.avail_out = out.size();
+  int ret = deflate( &stream, Z_FINISH );
+  out.resize( stream.total_out );
+  deflateEnd( &stream );
+
+  return ret == Z_STREAM_END ? out : "";
+}
+
+AssetCache::AssetCache( const string &root )
+  : root_( root ), inotify_fd_{ inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) }
+{
+  if( inotify_fd_ < 0 )
+  {
+    WARN( "No inotify ({}), assets will never be reloaded", strerror( errno ));
+  }
+}
+
+AssetCache::~AssetCache ()
+{
+  if( inotify_fd_ >= 0 )
+  {
+    close( inotify_fd_ );
+  }
+}
+
+shared_ptr<const Asset> AssetCache::Get( const string &url_path )
+{
+  string rel_path = url_path == "/" ? "index.html" : url_path.substr( 1 );
+  if( rel_path.empty() || rel_path[0] == '/' ||
+      rel_path.find( ".." ) != string::npos )
+  {
+    return nullptr;
+  }
+
+  {
+    lock_guard<mutex> lock( mutex_ );
+    auto cached = assets_.find( rel_path );
+    if( cached != assets_.end() )
+    {
+      return cached->second;
+    }
+  }
+
+  // Load outside the lock, two racing loads of one file are harmless
+  auto asset = Load( rel_path );
+  if( asset )
+  {
+    lock_guard<mutex> lock( mutex_ );
+    assets_[ rel_path ] = asset;
+  }
+  return asset;
+}
+
+shared_ptr<const Asset> AssetCache::Load( const string &rel_path )
+{
+  string full_path = pystring::os::path::join( root_, rel_path );
+  int fd = open( full_path.c_str(), O_RDONLY | O_CLOEXEC );
+  if( fd < 0 )
+  {
+    return nullptr;
+  }
+
+  struct stat st;
+  if( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ))
+  {
+    close( fd );
+    return nullptr;
+  }
+
+  // Watch before reading so a write racing the load still invalidates it
+  Watch( pystring::os::path::dirname( full_path ));
+
+  auto asset = make_shared<Asset>();
+  asset->mime = MimeType( rel_path );
+  asset->body.resize( st.st_size );
+  size_t done = 0;
+  while( done < asset->body.size() )
+  {
+    ssize_t got = read( fd, &asset->body[done], asset->body.size() - done );
+    if( got <= 0 )
+    {
+      if( got < 0 && errno == EINTR )
+      {
+        continue;
+      }
+      // Shrunk underneath us, inotify will have the next version
+      asset->body.resize( done );
+      break;
+    }
+    done += got;
+  }
+  close( fd );
+
+  const string &body = asset->body;
+  asset->etag = fmt::format( "\"{:016x}-{:x}\"",
+                             ContentHash( body.data(), body.size() ),
+                             body.size() );
+  if( body.size() >= MIN_GZIP_SIZE )
+  {
+    asset->gzip = Gzip( body.data(), body.size() );
+    if( asset->gzip.size() >= body.size() )
+    {
+      asset->gzip.clear();
+    }
+  }
+
+  INFO( "Cached '{}' ({} bytes, {} gzipped) as {}", rel_path, body.size(),
+        asset->gzip.size(), asset->mime );
+  return asset;
+}
+
+void AssetCache::Watch( const string &dir )
+{
+  if( inotify_fd_ < 0 )
+  {
+    return;
+  }
+
+  int wd = inotify_add_watch( inotify_fd_, dir.c_str(),
+      IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM |
+      IN_DELETE | IN_DELETE_SELF );
+  if( wd < 0 )
+  {
+    WARN( "Cannot watch '{}': {}", dir, strerror( errno ));
+    return;
+  }
+
+  lock_guard<mutex> lock( mutex_ );
+  watches_[ wd ] = dir;
+}
+
+void AssetCache::ProcessEvents ()
+{
+  alignas( inotify_event ) char buf[4096];
+  ssize_t len;
+  while( (len = read( inotify_fd_, buf, sizeof( buf ))) > 0 )
+  {
+    lock_guard<mutex> lock( mutex_ );
+    for( char *ptr = buf; ptr < buf + len; )
+    {
+      auto event = reinterpret_cast<const inotify_event*>( ptr );
+      ptr += sizeof( inotify_event ) + event->len;
+
+      auto watch = watches_.find( event->wd );
+      if( watch == watches_.end() )
+      {
+        continue;
+      }
+
+      if( event->mask & ( IN_DELETE_SELF | IN_IGNORED ))
+      {
+        // The whole directory went away, drop everything
+        assets_.clear();
+        watches_.erase( watch );
+        continue;
+      }
+      if( event->len == 0 )
+      {
+        continue;
+      }
+
+      string full_path = pystring::os::path::join( watch->second,
+                                                   event->name );
+      string root = pystring::os::path::join( root_, "" );
+      if( pystring::startswith( full_path, root ))
+      {
+        string rel_path = full_path.substr( root.size() );
+        if( assets_.erase( rel_path ))
+        {
+          INFO( "Asset '{}' changed, reloading on next request", rel_path );
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,248 @@
+#include <vector>
+
+#include "calibration.h"
+#include "logging.h"
+
+using namespace std;
+using namespace Eigen;
+
+// Corner points needed before the per-corner model replaces the quadratic.
+static constexpr size_t MIN_CORNER_POINTS = 8;
+
+static MatrixXd QuadraticDesign( const VectorXd &wii )
+{
+  MatrixXd A = MatrixXd::Ones( wii.rows(), 3 );
+  A.col(0) = wii.asDiagonal()*wii;
+  A.col(1) = wii;
+  return A;
+}
+
+VectorXd FitNormalEquations( const VectorXd &wii, const VectorXd &scale )
+{
+  MatrixXd A = QuadraticDesign( wii );
+  return (A.adjoint() * A).llt().solve( A.adjoint() * scale );
+}
+
+VectorXd FitQr( const VectorXd &wii, const VectorXd &scale )
+{
+  return QuadraticDesign( wii ).householderQr().solve( scale );
+}
+
+VectorXd GetCalibrationCoefficients ( sqlite::database &db )
+{
+  vector<double> scale_values_raw;
+  vector<double> wii_values_raw;
+
+  db << "SELECT scale, wii FROM calibration;"
+    >> [&]( double scale, double wii ) {
+      scale_values_raw.push_back( scale );
+      wii_values_raw.push_back( wii );
+    };
+
+  return FitQr( Map<VectorXd>( wii_values_raw.data(), wii_values_raw.size() ),
+                Map<VectorXd>( scale_values_raw.data(),
+                               scale_values_raw.size() ));
+}
+
+// (A^T A)^-1 from the R factor of A, without forming A^T A.
+template <typename Derived>
+static MatrixXd InverseInformation( const MatrixBase<Derived> &A )
+{
+  auto qr = A.householderQr();
+  MatrixXd R = qr.matrixQR().topRows( A.cols() )
+    .template triangularView<Upper>();
+  MatrixXd R_inv = R.triangularView<Upper>().solve(
+      MatrixXd::Identity( A.cols(), A.cols() ));
+  return R_inv * R_inv.transpose();
+}
+
+// One recursive least squares step for observation y = x^T theta.
+template <int N>
+static void RlsUpdate( Matrix<double, N, 1> &theta, Matrix<double, N, N> &P,
+                       const Matrix<double, N, 1> &x, double y )
+{
+  Matrix<double, N, 1> Px = P * x;
+  Matrix<double, N, 1> gain = Px / ( 1.0 + x.dot( Px ));
+  theta += gain * ( y - x.dot( theta ));
+  P -= gain * Px.transpose();
+}
+
+// Tables from before per-device profiles get a device column, their rows
+// becoming the shared profile.
+static void AddDeviceColumn( sqlite::database &db, const string &table )
+{
+  bool has_device = false;
+  db << "PRAGMA table_info(" + table + ");"
+    >> [&has_device]( int cid, string name, string type, int notnull,
+                      unique_ptr<string> dflt, int pk ) {
+      (void) cid;
+      (void) type;
+      (void) notnull;
+      (void) dflt;
+      (void) pk;
+      has_device = has_device || name == "device";
+    };
+  if( !has_device )
+  {
+    db << "ALTER TABLE " + table +
+      " ADD COLUMN device INTEGER NOT NULL DEFAULT 0;";
+  }
+}
+
+void CreateCalibrationTables( sqlite::database &db )
+{
+  db << "CREATE TABLE IF NOT EXISTS calibration( "
+    "id INTEGER PRIMARY KEY,"
+    "scale DOUBLE,"
+    "wii DOUBLE,"
+    "device INTEGER NOT NULL DEFAULT 0 );";
+  db << "CREATE TABLE IF NOT EXISTS corner_calibration( "
+    "id INTEGER PRIMARY KEY,"
+    "scale DOUBLE,"
+    "c0 DOUBLE, c1 DOUBLE, c2 DOUBLE, c3 DOUBLE,"
+    "device INTEGER NOT NULL DEFAULT 0 );";
+  AddDeviceColumn( db, "calibration" );
+  AddDeviceColumn( db, "corner_calibration" );
+}
+
+Calibrator::Calibrator( sqlite::database &db, uint32_t device )
+  : db_( db ), device_{ device }, borrowed_{ false }, corner_points_{ 0 }
+{
+  CreateCalibrationTables( db_ );
+  Refit();
+}
+
+shared_ptr<const CalibrationModel> Calibrator::Current () const
+{
+  return atomic_load( &model_ );
+}
+
+void Calibrator::Publish( CalibrationModel model )
+{
+  auto previous = atomic_load( &model_ );
+  model.version = previous ? previous->version + 1 : 1;
+  atomic_store( &model_, shared_ptr<const CalibrationModel>(
+        make_shared<CalibrationModel>( model )));
+  INFO( "Calibration v{} of device {}: {:.6g} {:.6g} {:.6g}{}", model.version,
+        device_, model.coefs[0], model.coefs[1], model.coefs[2],
+        model.per_corner ? " (per-corner)" : "" );
+}
+
+void Calibrator::Refit ()
+{
+  lock_guard<mutex> lock( write_mutex_ );
+
+  vector<double> scale_raw;
+  vector<double> wii_raw;
+  auto select = db_ << "SELECT scale, wii FROM calibration WHERE device = ?;";
+  select.used( true );
+  auto collect = [&]( double scale, double wii ) {
+    scale_raw.push_back( scale );
+    wii_raw.push_back( wii );
+  };
+  select << int( device_ );
+  select >> collect;
+  // Too few points of its own to pin a quadratic, fit them with the shared
+  borrowed_ = device_ != 0 && scale_raw.size() < 3;
+  if( borrowed_ )
+  {
+    select << 0;
+    select >> collect;
+  }
+
+  Map<VectorXd> scale( scale_raw.data(), scale_raw.size() );
+  Map<VectorXd> wii( wii_raw.data(), wii_raw.size() );
+  if( scale.rows() < 3 )
+  {
+    FATAL( "Need at least 3 calibration points, have {}", scale.rows() );
+  }
+
+  MatrixXd A = QuadraticDesign( wii );
+  theta_ = A.householderQr().solve( scale );
+  p_ = InverseInformation( A );
+
+  vector<double> corner_rows;
+  db_ << "SELECT scale, c0, c1, c2, c3 FROM corner_calibration "
+    "WHERE device = ?;"
+    << int( device_ )
+    >> [&]( double scale, double c0, double c1, double c2, double c3 ) {
+      corner_rows.insert( corner_rows.end(), { scale, c0, c1, c2, c3 });
+    };
+
+  corner_points_ = corner_rows.size() / 5;
+  Map<Matrix<double, Dynamic, 5, RowMajor>> rows( corner_rows.data(),
+                                                  corner_points_, 5 );
+  if( corner_points_ >= MIN_CORNER_POINTS )
+  {
+    MatrixXd C( corner_points_, 5 );
+    C << rows.rightCols( 4 ), VectorXd::Ones( corner_points_ );
+    corner_theta_ = C.householderQr().solve( rows.col( 0 ));
+    corner_p_ = InverseInformation( C );
+  }
+  else
+  {
+    // Uninformative prior, the rows we do have are folded in recursively
+    corner_theta_ << 1, 1, 1, 1, 0;
+    corner_p_ = Matrix<double, 5, 5>::Identity() * 1e6;
+    for( size_t idx=0; idx < corner_points_; ++idx )
+    {
+      Matrix<double, 5, 1> x;
+      x << rows.row( idx ).rightCols( 4 ).transpose(), 1;
+      RlsUpdate<5>( corner_theta_, corner_p_, x, rows( idx, 0 ));
+    }
+  }
+
+  CalibrationModel model;
+  model.coefs = theta_;
+  model.per_corner = corner_points_ >= MIN_CORNER_POINTS;
+  model.corner_gains = corner_theta_.head<4>();
+  model.corner_offset = corner_theta_[4];
+  Publish( model );
+}
+
+void Calibrator::AddPoint( double scale, double wii )
+{
+  lock_guard<mutex> lock( write_mutex_ );
+
+  db_ << "INSERT INTO calibration (scale, wii, device) values (?, ?, ?);"
+    << scale
+    << wii
+    << int( device_ );
+
+  RlsUpdate<3>( theta_, p_, Vector3d( wii*wii, wii, 1 ), scale );
+
+  CalibrationModel model = *atomic_load( &model_ );
+  model.coefs = theta_;
+  Publish( model );
+}
+
+void Calibrator::AddCornerPoint( double scale, const Vector4d &corners )
+{
+  lock_guard<mutex> lock( write_mutex_ );
+
+  // Both updates go out as one model, readers never see just the first
+  double wii = corners.sum();
+  db_ << "INSERT INTO calibration (scale, wii, device) values (?, ?, ?);"
+    << scale
+    << wii
+    << int( device_ );
+  RlsUpdate<3>( theta_, p_, Vector3d( wii*wii, wii, 1 ), scale );
+
+  db_ << "INSERT INTO corner_calibration (scale, c0, c1, c2, c3, device) "
+    "values (?, ?, ?, ?, ?, ?);"
+    << scale
+    << corners[0] << corners[1] << corners[2] << corners[3]
+    << int( device_ );
+
+  Matrix<double, 5, 1> x;
+  x << corners, 1;
+  RlsUpdate<5>( corner_theta_, corner_p_, x, scale );
+  ++corner_points_;
+
+  CalibrationModel model = *atomic_load( &model_ );
+  model.coefs = theta_;
+  model.per_corner = corner_points_ >= MIN_CORNER_POINTS;
+  model.corner_gains = corner_theta_.head<4>();
+  model.corner_offset = corner_theta_[4];
+  Publish( model );
+}
@@ -0,0 +1,96 @@
+#include "convert.h"
+
+using namespace std;
+using namespace Eigen;
+
+// Below this total (pounds) the center of pressure is meaningless
+static constexpr double MIN_COP_POUNDS = 1.0;
+
+void RawBatch::Clear ()
+{
+  timestamp_us.clear();
+  for( auto &corner : corners )
+  {
+    corner.clear();
+  }
+}
+
+void RawBatch::Reserve( size_t n )
+{
+  timestamp_us.reserve( n );
+  for( auto &corner : corners )
+  {
+    corner.reserve( n );
+  }
+}
+
+void RawBatch::Append( const RawSample &sample )
+{
+  timestamp_us.push_back( sample.timestamp_us );
+  for( int i=0; i < 4; ++i )
+  {
+    corners[i].push_back( sample.corners[i] );
+  }
+}
+
+void RawBatch::Append( const RawSample *samples, size_t n )
+{
+  Reserve( Size() + n );
+  for( size_t idx=0; idx < n; ++idx )
+  {
+    Append( samples[idx] );
+  }
+}
+
+void ConvertedBatch::Resize( size_t n )
+{
+  weight.resize( n );
+  cop_x.resize( n );
+  cop_y.resize( n );
+}
+
+void ConvertBatch( const int32_t *const corners[4], size_t n,
+                   const CalibrationModel &model,
+                   double *weight, double *cop_x, double *cop_y )
+{
+  typedef Map<const Array<int32_t, Dynamic, 1>> RawColumn;
+  auto tr = RawColumn( corners[TOP_RIGHT], n ).cast<double>() * RAW_TO_POUNDS;
+  auto bl = RawColumn( corners[BOTTOM_LEFT], n ).cast<double>() * RAW_TO_POUNDS;
+  auto tl = RawColumn( corners[TOP_LEFT], n ).cast<double>() * RAW_TO_POUNDS;
+  auto br = RawColumn( corners[BOTTOM_RIGHT], n ).cast<double>() * RAW_TO_POUNDS;
+
+  Map<ArrayXd> w( weight, n );
+  Map<ArrayXd> x( cop_x, n );
+  Map<ArrayXd> y( cop_y, n );
+
+  // The raw total is parked in w so each expression below is a single
+  // element-wise loop that Eigen can vectorize.
+  w = tr + bl + tl + br;
+  x = ( w > MIN_COP_POUNDS ).select(
+      (( tr + br ) - ( tl + bl )) / w * ( BOARD_WIDTH_MM / 2 ), 0.0 );
+  y = ( w > MIN_COP_POUNDS ).select(
+      (( tl + tr ) - ( bl + br )) / w * ( BOARD_LENGTH_MM / 2 ), 0.0 );
+
+  if( model.per_corner )
+  {
+    const auto &g = model.corner_gains;
+    w = g[TOP_RIGHT]*tr + g[BOTTOM_LEFT]*bl + g[TOP_LEFT]*tl +
+      g[BOTTOM_RIGHT]*br + model.corner_offset;
+  }
+  else
+  {
+    const auto &c = model.coefs;
+    w = ( c[0]*w + c[1] )*w + c[2];
+  }
+}
+
+void ConvertBatch( const RawBatch &raw, const CalibrationModel &model,
+                   ConvertedBatch *out )
+{
+  const int32_t *const corners[4] = {
+    raw.corners[0].data(), raw.corners[1].data(),
+    raw.corners[2].data(), raw.corners[3].data() };
+  out->Resize( raw.Size() );
+  ConvertBatch( corners, raw.Size(), model,
+                out->weight.data(), out->cop_x.data(), out->cop_y.data() );
+}
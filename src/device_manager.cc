@@ -0,0 +1,326 @@
+#include <cstring>
+#include <fstream>
+
+#include <xwiimote.h>
+
+#include "device_manager.h"
+#include "logging.h"
+
+using namespace std;
+
+static constexpr size_t RING_SIZE = 4096;
+
+// How often the per-device sample rates are brought up to date.
+static const timeval STATS_INTERVAL = { 1, 0 };
+
+// The board's bluetooth address, from the HID_UNIQ of the hid device behind
+// syspath.  Falls back to the syspath itself, which is only stable for as
+// long as the board stays connected.
+static string BoardAddress( const string &syspath )
+{
+  ifstream uevent( syspath + "/uevent" );
+  string line;
+  while( getline( uevent, line ))
+  {
+    if( line.compare( 0, 9, "HID_UNIQ=" ) == 0 && line.size() > 9 )
+    {
+      return line.substr( 9 );
+    }
+  }
+  return syspath;
+}
+
+DeviceManager::DeviceManager( event_base *base, sqlite::database &db,
+                              MeasurementStore &store )
+  : base_( base ), db_( db ), store_( store ), monitor_{ nullptr },
+    monitor_event_{ nullptr }, stats_timer_{ nullptr },
+    stats_us_{ MonotonicMicros() }, shared_( db, 0 )
+{
+  db_ << "CREATE TABLE IF NOT EXISTS devices( "
+    "id INTEGER PRIMARY KEY,"
+    "address TEXT NOT NULL UNIQUE );";
+
+  stats_timer_ = event_new( base_, -1, EV_PERSIST, StatsCallback, this );
+  event_add( stats_timer_, &STATS_INTERVAL );
+}
+
+DeviceManager::~DeviceManager ()
+{
+  for( auto &entry : devices_ )
+  {
+    if( entry.second.reader )
+    {
+      entry.second.reader->Stop();
+    }
+  }
+  event_free( stats_timer_ );
+  if( monitor_event_ )
+  {
+    event_free( monitor_event_ );
+  }
+  if( monitor_ )
+  {
+    ::xwii_monitor_unref( monitor_ );
+  }
+}
+
+void DeviceManager::Watch ()
+{
+  monitor_ = ::xwii_monitor_new( true, false );
+  if( !monitor_ )
+  {
+    throw runtime_error( "cannot create an xwiimote monitor" );
+  }
+
+  int fd = ::xwii_monitor_get_fd( monitor_, false );
+  if( fd < 0 )
+  {
+    ::xwii_monitor_unref( monitor_ );
+    monitor_ = nullptr;
+    throw runtime_error( "xwiimote monitor has no descriptor" );
+  }
+
+  monitor_event_ = event_new( base_, fd, EV_READ | EV_PERSIST,
+                              MonitorCallback, this );
+  event_add( monitor_event_, nullptr );
+  INFO( "Watching for balance boards" );
+
+  // The monitor lists what is already connected before any hotplug events
+  Scan();
+}
+
+void DeviceManager::Scan ()
+{
+  char *path;
+  while( (path = ::xwii_monitor_poll( monitor_ )) != nullptr )
+  {
+    string syspath = path;
+    free( path );
+    Open( syspath );
+  }
+}
+
+void DeviceManager::Open( const string &path )
+{
+  ::xwii_iface *iface;
+  if( ::xwii_iface_new( &iface, path.c_str() ) < 0 )
+  {
+    WARN( "Couldn't create interface for {}", path );
+    return;
+  }
+
+  char *dev_type;
+  if( ::xwii_iface_get_devtype( iface, &dev_type ) < 0 )
+  {
+    WARN( "Couldn't get devtype for {}", path );
+    ::xwii_iface_unref( iface );
+    return;
+  }
+  bool is_board = strcmp( dev_type, "balanceboard" ) == 0;
+  DEBUG( "{} is a {}", path, dev_type );
+  free( dev_type );
+  if( !is_board )
+  {
+    ::xwii_iface_unref( iface );
+    return;
+  }
+
+  Device &device = Find( BoardAddress( path ));
+  if( device.connected )
+  {
+    // Reported again, e.g. by both the enumeration and a hotplug event
+    ::xwii_iface_unref( iface );
+    return;
+  }
+
+  int ret = ::xwii_iface_open( iface, XWII_IFACE_BALANCE_BOARD );
+  if( ret != 0 )
+  {
+    WARN( "Can't open balance board {}: {}", device.address, ret );
+    ::xwii_iface_unref( iface );
+    return;
+  }
+
+  unique_ptr<SensorSource> source( new XwiiSource( iface ));
+  if( !record_prefix_.empty() )
+  {
+    source.reset( new RecordingSource( move( source ), fmt::format(
+        "{}.{}", record_prefix_, device.id )));
+  }
+  device.pipeline->ReadOnLoop( base_, move( source ));
+  Connected( &device );
+}
+
+uint32_t DeviceManager::Attach( const string &address,
+                                unique_ptr<SensorSource> source,
+                                int reader_cpu )
+{
+  Device &device = Find( address );
+  if( reader_cpu >= 0 )
+  {
+    device.reader.reset( new SensorReader( move( source ), *device.ring ));
+    device.reader->Start( reader_cpu );
+    device.pipeline->ConsumeOnLoop( base_, *device.reader );
+  }
+  else
+  {
+    device.pipeline->ReadOnLoop( base_, move( source ));
+  }
+  Connected( &device );
+  return device.id;
+}
+
+void DeviceManager::Connected( Device *device )
+{
+  device->connected = true;
+  if( device->connects++ > 0 )
+  {
+    INFO( "Device {} ({}) reconnected", device->id, device->address );
+  }
+  else
+  {
+    INFO( "Device {} ({}) connected", device->id, device->address );
+  }
+}
+
+DeviceManager::Device& DeviceManager::Find( const string &address )
+{
+  for( auto &entry : devices_ )
+  {
+    if( entry.second.address == address )
+    {
+      return entry.second;
+    }
+  }
+
+  db_ << "INSERT OR IGNORE INTO devices (address) VALUES (?);" << address;
+  uint32_t id = 0;
+  db_ << "SELECT id FROM devices WHERE address = ?;" << address
+    >> [&id]( int device_id ) {
+      id = uint32_t( device_id );
+    };
+
+  Device device;
+  device.id = id;
+  device.address = address;
+  device.calibrator.reset( new Calibrator( db_, id ));
+  device.ring.reset( new SampleRing<RawSample>( RING_SIZE ));
+  device.pipeline.reset( new SamplePipeline( id, *device.calibrator, store_,
+      *device.ring, [this, id]( const SettleEvent &event ) {
+        if( on_event_ )
+        {
+          on_event_( id, event );
+        }
+      }));
+  device.pipeline->OnBatch( [this, id]( const RawBatch &raw,
+                                        const ConvertedBatch &converted ) {
+      if( on_batch_ )
+      {
+        on_batch_( id, raw, converted );
+      }
+    });
+  device.pipeline->OnSway( [this, id]( const SwayMetrics &sway ) {
+      if( on_sway_ )
+      {
+        on_sway_( id, sway );
+      }
+    });
+  device.pipeline->OnSession( [this]( const SwaySession &session ) {
+      if( on_session_ )
+      {
+        on_session_( session );
+      }
+    });
+  device.pipeline->Identify( identify_ );
+  device.pipeline->OnFinish( [this, id]() {
+      Device &gone = devices_.at( id );
+      gone.connected = false;
+      WARN( "Device {} ({}) disconnected", id, gone.address );
+    });
+  device.connected = false;
+  device.connects = 0;
+  device.rate_samples = 0;
+  device.rate = 0;
+
+  lock_guard<mutex> lock( devices_mutex_ );
+  return devices_.emplace( id, move( device )).first->second;
+}
+
+Calibrator& DeviceManager::CalibrationFor( uint32_t device )
+{
+  if( device == 0 )
+  {
+    return shared_;
+  }
+  lock_guard<mutex> lock( devices_mutex_ );
+  auto found = devices_.find( device );
+  if( found == devices_.end() )
+  {
+    throw runtime_error( fmt::format( "no device {}", device ));
+  }
+  return *found->second.calibrator;
+}
+
+void DeviceManager::SharedCalibrationChanged ()
+{
+  for( auto &entry : devices_ )
+  {
+    if( entry.second.calibrator->Borrowed() )
+    {
+      entry.second.calibrator->Refit();
+    }
+  }
+}
+
+vector<uint32_t> DeviceManager::SharedProfileDevices () const
+{
+  vector<uint32_t> devices = { 0 };
+  lock_guard<mutex> lock( devices_mutex_ );
+  for( const auto &entry : devices_ )
+  {
+    if( entry.second.calibrator->Borrowed() )
+    {
+      devices.push_back( entry.first );
+    }
+  }
+  return devices;
+}
+
+vector<DeviceStats> DeviceManager::Stats () const
+{
+  vector<DeviceStats> stats;
+  for( const auto &entry : devices_ )
+  {
+    const Device &device = entry.second;
+    stats.push_back( DeviceStats{ device.id, device.address,
+        device.connected, device.pipeline->SamplesProcessed(),
+        device.pipeline->Dropped(),
+        device.connects > 0 ? device.connects - 1 : 0, device.rate } );
+  }
+  return stats;
+}
+
+void DeviceManager::MonitorCallback( evutil_socket_t fd, short what,
+                                     void *arg )
+{
+  (void) fd;
+  (void) what;
+  static_cast<DeviceManager*>( arg )->Scan();
+}
+
+void DeviceManager::StatsCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  auto manager = static_cast<DeviceManager*>( arg );
+  uint64_t now = MonotonicMicros();
+  double seconds = ( now - manager->stats_us_ ) / 1e6;
+  manager->stats_us_ = now;
+  for( auto &entry : manager->devices_ )
+  {
+    Device &device = entry.second;
+    uint64_t samples = device.pipeline->SamplesProcessed();
+    device.rate = ( samples - device.rate_samples ) / seconds;
+    device.rate_samples = samples;
+  }
+}
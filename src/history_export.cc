@@ -0,0 +1,242 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <sqlite3.h>
+
+#include "history_export.h"
+#include "http_server.h"
+#include "logging.h"
+#include "metrics.h"
+
+using namespace std;
+
+// Without a user the export walks the table in rowid order, which is the
+// order rows were stored in; ordering all users by time would make SQLite
+// sort the whole history before handing over the first row.  A user's rows
+// come off the (user_id, timestamp_us) index in time order as they are.
+//
+// Each batch is its own query, picking up after the last row sent (?5, ?6)
+// and stopping after ?7 rows, so no read transaction outlives a batch.  The
+// first column, id, is the cursor and isn't exported.
+static const char ALL_USERS_QUERY[] =
+  "SELECT id, timestamp_us, device, user_id, weight, stddev, confidence, "
+  "cop_x, cop_y FROM measurements WHERE id > ?6 AND timestamp_us BETWEEN ?1 "
+  "AND ?2 AND ( ?3 < 0 OR device = ?3 ) ORDER BY id LIMIT ?7;";
+static const char USER_QUERY[] =
+  "SELECT id, timestamp_us, device, user_id, weight, stddev, confidence, "
+  "cop_x, cop_y FROM measurements WHERE user_id = ?4 AND timestamp_us "
+  "BETWEEN ?1 AND ?2 AND ( timestamp_us > ?5 OR ( timestamp_us = ?5 AND "
+  "id > ?6 )) AND ( ?3 < 0 OR device = ?3 ) ORDER BY timestamp_us, id "
+  "LIMIT ?7;";
+
+struct HistoryExport::Export
+{
+  HistoryExport *exporter;
+  evhtp_request_t *req;
+  shared_ptr<sqlite3> db;   // Keeps the connection open for stmt
+  sqlite3_stmt *stmt;       // Null once the last row has been queued
+  int64_t last_us;          // Where the next batch picks up
+  int64_t last_id;
+  evbuffer *rows;
+  bool ndjson;
+  uint64_t count;
+};
+
+static int64_t QueryInt( evhtp_request_t *req, const char *key,
+                         int64_t fallback )
+{
+  const char *value = req->uri->query ?
+    evhtp_kv_find( req->uri->query, key ) : nullptr;
+  return value ? strtoll( value, nullptr, 10 ) : fallback;
+}
+
+// One row as a CSV line or an NDJSON object, NULLs as empty fields or null.
+static void AddRow( sqlite3_stmt *stmt, bool ndjson, evbuffer *out )
+{
+  int columns = sqlite3_column_count( stmt );
+  evbuffer_add( out, "{", ndjson ? 1 : 0 );
+  for( int col=1; col < columns; ++col )
+  {
+    if( col > 1 )
+    {
+      evbuffer_add( out, ",", 1 );
+    }
+    if( ndjson )
+    {
+      evbuffer_add_printf( out, "\"%s\":", sqlite3_column_name( stmt, col ));
+    }
+    switch( sqlite3_column_type( stmt, col ))
+    {
+      case SQLITE_INTEGER:
+        evbuffer_add_printf( out, "%lld",
+                             (long long) sqlite3_column_int64( stmt, col ));
+        break;
+      case SQLITE_FLOAT:
+        evbuffer_add_printf( out, "%.10g", sqlite3_column_double( stmt, col ));
+        break;
+      default:
+        evbuffer_add( out, "null", ndjson ? 4 : 0 );
+        break;
+    }
+  }
+  evbuffer_add( out, ndjson ? "}\n" : "\n", ndjson ? 2 : 1 );
+}
+
+// Queues the batch of rows after *last_us, *last_id and moves them on.
+// Returns false once there are no more.
+static bool Fill( sqlite3_stmt *stmt, size_t batch_rows, bool ndjson,
+                  evbuffer *rows, int64_t *last_us, int64_t *last_id,
+                  uint64_t *count )
+{
+  ScopedTimer timer( GlobalMetrics().export_batch );
+  sqlite3_bind_int64( stmt, 5, *last_us );
+  sqlite3_bind_int64( stmt, 6, *last_id );
+  sqlite3_bind_int64( stmt, 7, sqlite3_int64( batch_rows ));
+  size_t n = 0;
+  int rc;
+  while( (rc = sqlite3_step( stmt )) == SQLITE_ROW )
+  {
+    AddRow( stmt, ndjson, rows );
+    *last_id = sqlite3_column_int64( stmt, 0 );
+    *last_us = sqlite3_column_int64( stmt, 1 );
+    ++n;
+  }
+  // Ends the read transaction until the next batch
+  sqlite3_reset( stmt );
+  *count += n;
+  GlobalMetrics().export_rows.Add( n );
+  if( rc != SQLITE_DONE )
+  {
+    // The status line is long gone, all we can do is end the stream short
+    WARN( "History export stopped after {} rows: {}", *count,
+          sqlite3_errstr( rc ));
+    return false;
+  }
+  return n == batch_rows;
+}
+
+HistoryExport::HistoryExport( const Options &options )
+  : options_( options ), exports_{ 0 }
+{
+}
+
+HistoryExport::HistoryExport () : HistoryExport( Options() )
+{
+}
+
+void HistoryExport::ExportCallback( evhtp_request_t *req, void *arg )
+{
+  auto exporter = static_cast<HistoryExport*>( arg );
+
+  const char *format = req->uri->query ?
+    evhtp_kv_find( req->uri->query, "format" ) : nullptr;
+  if( format && strcmp( format, "csv" ) != 0 &&
+      strcmp( format, "ndjson" ) != 0 )
+  {
+    evhtp_send_reply( req, EVHTP_RES_BADREQ );
+    return;
+  }
+  bool ndjson = format && strcmp( format, "ndjson" ) == 0;
+  int64_t user_id = QueryInt( req, "user_id", -1 );
+
+  // The read connection of the thread serving the request, which is the
+  // only thread that ever touches the statement
+  shared_ptr<sqlite3> db = HttpServer::State( req ).db.connection();
+  sqlite3_stmt *stmt = nullptr;
+  int rc = sqlite3_prepare_v2( db.get(), user_id < 0 ? ALL_USERS_QUERY :
+                               USER_QUERY, -1, &stmt, nullptr );
+  if( rc != SQLITE_OK )
+  {
+    ERROR( "Cannot prepare history export: {}", sqlite3_errmsg( db.get() ));
+    sqlite3_finalize( stmt );
+    evhtp_send_reply( req, EVHTP_RES_SERVERR );
+    return;
+  }
+  sqlite3_bind_int64( stmt, 1, QueryInt( req, "start_us", 0 ));
+  sqlite3_bind_int64( stmt, 2, QueryInt( req, "end_us", INT64_MAX ));
+  sqlite3_bind_int64( stmt, 3, QueryInt( req, "device", -1 ));
+  sqlite3_bind_int64( stmt, 4, user_id );
+
+  evhtp_connection_t *conn = evhtp_request_get_connection( req );
+  auto ex = new Export{ exporter, req, db, stmt, INT64_MIN, 0, evbuffer_new(),
+                        ndjson, 0 };
+  evhtp_request_set_hook( req, evhtp_hook_on_request_fini,
+                          (evhtp_hook)(void (*)()) FinishedCallback, ex );
+
+  evhtp_headers_add_header( req->headers_out,
+      evhtp_header_new( "Content-Type", ndjson ? "application/x-ndjson" :
+                        "text/csv", 0, 0 ));
+  evhtp_headers_add_header( req->headers_out,
+      evhtp_header_new( "Content-Disposition", ndjson ?
+                        "attachment; filename=\"wiight.ndjson\"" :
+                        "attachment; filename=\"wiight.csv\"", 0, 0 ));
+  evhtp_send_reply_chunk_start( req, EVHTP_RES_OK );
+  if( !ndjson )
+  {
+    int columns = sqlite3_column_count( stmt );
+    for( int col=1; col < columns; ++col )
+    {
+      evbuffer_add_printf( ex->rows, col > 1 ? ",%s" : "%s",
+                           sqlite3_column_name( stmt, col ));
+    }
+    evbuffer_add( ex->rows, "\n", 1 );
+  }
+
+  // evhtp calls the write hook whenever the output has gone down to the
+  // bufferevent's low watermark, the cue for the next batch
+  bufferevent_setwatermark( conn->bev, EV_WRITE, exporter->options_.low_water,
+                            0 );
+  evhtp_connection_set_hook( conn, evhtp_hook_on_write,
+                             (evhtp_hook)(void (*)()) WriteCallback, ex );
+
+  size_t count = ++exporter->exports_;
+  INFO( "History export as {} for user {}, {} running",
+        ndjson ? "ndjson" : "csv", user_id, count );
+  WriteCallback( conn, ex );
+}
+
+// Ends the cursor and hands the connection back to evhtp as it found it.
+static void StopExport( evhtp_connection_t *conn, sqlite3_stmt **stmt )
+{
+  sqlite3_finalize( *stmt );
+  *stmt = nullptr;
+  evhtp_connection_unset_hook( conn, evhtp_hook_on_write );
+  bufferevent_setwatermark( conn->bev, EV_WRITE, 0, 0 );
+}
+
+evhtp_res HistoryExport::WriteCallback( evhtp_connection_t *conn, void *arg )
+{
+  auto ex = static_cast<Export*>( arg );
+  bool more = Fill( ex->stmt, ex->exporter->options_.batch_rows, ex->ndjson,
+                    ex->rows, &ex->last_us, &ex->last_id, &ex->count );
+  evhtp_send_reply_chunk( ex->req, ex->rows );
+  evbuffer_drain( ex->rows, evbuffer_get_length( ex->rows ));
+  if( !more )
+  {
+    StopExport( conn, &ex->stmt );
+    evhtp_send_reply_chunk_end( ex->req );
+  }
+  return EVHTP_RES_OK;
+}
+
+evhtp_res HistoryExport::FinishedCallback( evhtp_request_t *req, void *arg )
+{
+  auto ex = static_cast<Export*>( arg );
+  if( ex->stmt )
+  {
+    StopExport( evhtp_request_get_connection( req ), &ex->stmt );
+    INFO( "History export abandoned after {} rows", ex->count );
+  }
+  else
+  {
+    INFO( "History export of {} rows done", ex->count );
+  }
+  --ex->exporter->exports_;
+  evbuffer_free( ex->rows );
+  delete ex;
+  return EVHTP_RES_OK;
+}
@@ -0,0 +1,243 @@
+#include <signal.h>
+
+#include <cstring>
+#include <mutex>
+
+#include <event2/thread.h>
+
+#include "http_server.h"
+#include "logging.h"
+#include "measurement_store.h"
+#include "metrics.h"
+
+using namespace std;
+
+static const char UNKNOWN_RESOURCE[] = R"(
+  <html>
+  <head>
+  <title>Unknown Resource</title>
+  </head>
+  <body>
+  <h1>Unknown Resource</h1>
+  <p><a href="/">Go Home</a></p>
+  </body>
+  </html>
+  )";
+
+static void AddHeader( evhtp_request_t *req, const char *key,
+                       const char *value )
+{
+  // Copy the value, keys are always literals
+  evhtp_headers_add_header( req->headers_out,
+                            evhtp_header_new( key, value, 0, 1 ));
+}
+
+// Releases the asset reference that kept a body alive while libevent sent it
+static void ReleaseAsset( const void *data, size_t len, void *arg )
+{
+  (void) data;
+  (void) len;
+  delete static_cast<shared_ptr<const Asset>*>( arg );
+}
+
+HttpThreadState::HttpThreadState( const string &database )
+  : db( OpenTunedDatabase( database ))
+{
+}
+
+HttpServer::HttpServer( const Options &options )
+  : options_( options ), assets_( options.root ), evbase_{ nullptr },
+    htp_{ nullptr }, asset_changed_{ nullptr }, stop_{ nullptr },
+    main_state_( options.database )
+{
+  // Stop() activates an event from other threads, and evhtp's workers need
+  // locking too, so libevent has to be thread aware before the base exists.
+  static once_flag threads_enabled;
+  call_once( threads_enabled, []() { evthread_use_pthreads(); } );
+
+  evbase_ = event_base_new();
+  htp_ = evhtp_new( evbase_, this );
+
+  if( options_.threads > 0 )
+  {
+    evhtp_use_threads_wexit( htp_, InitThread, ExitThread, options_.threads,
+                             this );
+    INFO( "HTTP server using {} worker threads", options_.threads );
+  }
+
+  if( assets_.Fd() >= 0 )
+  {
+    asset_changed_ = event_new( evbase_, assets_.Fd(), EV_READ | EV_PERSIST,
+                                AssetChangedCallback, this );
+    event_add( asset_changed_, nullptr );
+  }
+
+  stop_ = event_new( evbase_, -1, 0, StopCallback, this );
+
+  if( evhtp_bind_socket( htp_, options_.address.c_str(), options_.port,
+                         2048 ) != 0 )
+  {
+    FATAL( "Cannot bind HTTP server to {}:{}", options_.address,
+           options_.port );
+  }
+}
+
+HttpServer::~HttpServer ()
+{
+  evhtp_unbind_socket( htp_ );
+  for( auto &signal : signals_ )
+  {
+    event_free( signal->ev );
+  }
+  if( asset_changed_ )
+  {
+    event_free( asset_changed_ );
+  }
+  event_free( stop_ );
+  // Stops and joins the worker threads, running ExitThread on each
+  evhtp_free( htp_ );
+  event_base_free( evbase_ );
+  INFO( "Stopped HTTP server" );
+}
+
+void HttpServer::AddHandler( const string &path, evhtp_callback_cb cb,
+                             void *arg )
+{
+  evhtp_set_cb( htp_, path.c_str(), cb, arg );
+}
+
+void HttpServer::OnSignal( int signum, function<void()> handler )
+{
+  unique_ptr<Signal> signal( new Signal );
+  signal->handler = move( handler );
+  signal->ev = evsignal_new( evbase_, signum, SignalCallback, signal.get() );
+  event_add( signal->ev, nullptr );
+  signals_.push_back( move( signal ));
+}
+
+void HttpServer::Run ()
+{
+  // evhtp matches callbacks in the order they were added, so the catch-all
+  // goes in last, after every AddHandler() path.
+  evhtp_set_glob_cb( htp_, "*", RootCallback, this );
+  INFO( "Started HTTP server on port {}", options_.port );
+  event_base_loop( evbase_, 0 );
+}
+
+void HttpServer::Stop ()
+{
+  event_active( stop_, EV_TIMEOUT, 0 );
+}
+
+HttpThreadState& HttpServer::State( evhtp_request_t *req )
+{
+  evhtp_connection_t *conn = evhtp_request_get_connection( req );
+  if( conn->thread )
+  {
+    return *static_cast<HttpThreadState*>( evthr_get_aux( conn->thread ));
+  }
+  return static_cast<HttpServer*>( conn->htp->arg )->main_state_;
+}
+
+void HttpServer::InitThread( evhtp_t *htp, evthr_t *thr, void *arg )
+{
+  (void) htp;
+  auto server = static_cast<HttpServer*>( arg );
+  evthr_set_aux( thr, new HttpThreadState( server->options_.database ));
+}
+
+void HttpServer::ExitThread( evhtp_t *htp, evthr_t *thr, void *arg )
+{
+  (void) htp;
+  (void) arg;
+  delete static_cast<HttpThreadState*>( evthr_get_aux( thr ));
+  evthr_set_aux( thr, nullptr );
+}
+
+void HttpServer::StopCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  event_base_loopbreak( static_cast<HttpServer*>( arg )->evbase_ );
+}
+
+void HttpServer::SignalCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  static_cast<Signal*>( arg )->handler();
+}
+
+// Drains inotify so changed assets are reloaded on their next request
+void HttpServer::AssetChangedCallback( evutil_socket_t fd, short what,
+                                       void *arg )
+{
+  (void) fd;
+  (void) what;
+  static_cast<HttpServer*>( arg )->assets_.ProcessEvents();
+}
+
+void HttpServer::RootCallback( evhtp_request_t *req, void *arg )
+{
+  auto server = static_cast<HttpServer*>( arg );
+  ScopedTimer timer( GlobalMetrics().http_request );
+  GlobalMetrics().http_requests.Add();
+
+  if( req->uri->path->full )
+  {
+    DEBUG( "Got a request for '{}'", req->uri->path->full );
+  }
+  else
+  {
+    INFO( "Unknown query" );
+    evhtp_send_reply( req, EVHTP_RES_NOTFOUND );
+    return;
+  }
+
+  auto asset = server->assets_.Get( req->uri->path->full );
+  if( !asset )
+  {
+    WARN( "Unknown path '{}', using default message", req->uri->path->full );
+    evbuffer_add_reference( req->buffer_out, UNKNOWN_RESOURCE,
+                            sizeof( UNKNOWN_RESOURCE ) - 1, nullptr, nullptr );
+    AddHeader( req, "Content-Type", "text/html; charset=utf-8" );
+    evhtp_send_reply( req, EVHTP_RES_NOTFOUND );
+    return;
+  }
+
+  AddHeader( req, "ETag", asset->etag.c_str() );
+  AddHeader( req, "Cache-Control", "no-cache" );
+  AddHeader( req, "Vary", "Accept-Encoding" );
+
+  const char *if_none_match = evhtp_header_find( req->headers_in,
+                                                 "If-None-Match" );
+  if( if_none_match && EtagMatches( if_none_match, asset->etag ))
+  {
+    evhtp_send_reply( req, EVHTP_RES_NOTMOD );
+    return;
+  }
+
+  const char *accept_encoding = evhtp_header_find( req->headers_in,
+                                                   "Accept-Encoding" );
+  bool use_gzip = !asset->gzip.empty() && accept_encoding &&
+    AcceptsGzip( accept_encoding );
+  const string &body = use_gzip ? asset->gzip : asset->body;
+
+  // The body goes out by reference, the cache entry stays alive until
+  // libevent is done with it even if the file is invalidated meanwhile.
+  if( !body.empty() )
+  {
+    evbuffer_add_reference( req->buffer_out, body.data(), body.size(),
+                            ReleaseAsset,
+                            new shared_ptr<const Asset>( asset ));
+  }
+
+  AddHeader( req, "Content-Type", asset->mime.c_str() );
+  AddHeader( req, "Content-Language", "en" );
+  if( use_gzip )
+  {
+    AddHeader( req, "Content-Encoding", "gzip" );
+  }
+
+  evhtp_send_reply( req, EVHTP_RES_OK );
+}
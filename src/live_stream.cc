@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "live_stream.h"
+#include "logging.h"
+#include "metrics.h"
+#include "sensor_source.h"
+
+using namespace std;
+
+struct LiveStream::Subscriber
+{
+  LiveStream *stream;
+  evhtp_request_t *req;
+  event *timer;
+  SampleRing<LiveSample>::Reader samples;
+  SampleRing<LiveEvent>::Reader events;
+  SampleRing<LiveSway>::Reader sways;
+  evbuffer *frames;
+  std::vector<LiveSample> latest;  // Unsent newest sample of each board
+  std::vector<LiveSway> latest_sway;
+  long device;                     // The board subscribed to, -1 for all
+  bool binary;
+};
+
+LiveStream::LiveStream( const Options &options )
+  : options_( options ), samples_( options.capacity ), events_( 256 ),
+    sways_( 256 ), subscribers_{ 0 }, coalesced_{ 0 }
+{
+}
+
+LiveStream::LiveStream () : LiveStream( Options() )
+{
+}
+
+void LiveStream::Publish( uint32_t device, const RawBatch &raw,
+                          const ConvertedBatch &converted )
+{
+  uint64_t now = MonotonicNanos();
+  for( size_t idx=0; idx < raw.Size(); ++idx )
+  {
+    samples_.Push( LiveSample{ raw.timestamp_us[idx], converted.weight[idx],
+                               converted.cop_x[idx], converted.cop_y[idx],
+                               device, now } );
+  }
+}
+
+void LiveStream::Publish( uint32_t device, const SettleEvent &event )
+{
+  events_.Push( LiveEvent{ device, event, MonotonicNanos() } );
+}
+
+void LiveStream::Publish( uint32_t device, const SwayMetrics &sway )
+{
+  sways_.Push( LiveSway{ device, sway, MonotonicNanos() } );
+}
+
+// Keeps item as the newest of its board in latest, returning true if it
+// replaced an unsent one.
+template <typename T>
+static bool Coalesce( const T &item, std::vector<T> *latest )
+{
+  auto found = find_if( latest->begin(), latest->end(), [&item]( const T &t ) {
+      return t.device == item.device;
+    });
+  if( found == latest->end() )
+  {
+    latest->push_back( item );
+    return false;
+  }
+  *found = item;
+  return true;
+}
+
+// Appends a sway window as a text/event-stream event, spectrum included.
+// The whole way from the board, reader, ring, conversion and settle detection
+// included, by the wall clock the board's timestamps are on.  Replayed logs
+// keep the time they were recorded, and count as however long ago that was.
+static void RecordSensorLatency( uint64_t timestamp_us )
+{
+  uint64_t now = WallMicros();
+  GlobalMetrics().sensor_to_client.Record(
+    now > timestamp_us ? ( now - timestamp_us ) * 1000 : 0 );
+}
+
+static void AddSwayEvent( const LiveSway &live_sway, evbuffer *frames )
+{
+  const SwayMetrics &w = live_sway.sway;
+  evbuffer_add_printf( frames, "event: sway\ndata: {\"device\":%u,\"t\":%lu,"
+                       "\"samples\":%u,\"path_length\":%.2f,"
+                       "\"mean_velocity\":%.3f,\"rms\":%.3f,\"rms_x\":%.3f,"
+                       "\"rms_y\":%.3f,\"ellipse_area\":%.2f,"
+                       "\"mean_frequency\":%.3f,\"bin_hz\":%.4f,",
+                       live_sway.device, (unsigned long) w.timestamp_us,
+                       w.samples, w.path_length, w.mean_velocity, w.rms,
+                       w.rms_x, w.rms_y, w.ellipse_area, w.mean_frequency,
+                       w.bin_hz );
+  const char *names[] = { "spectrum_x", "spectrum_y" };
+  const double *spectra[] = { w.spectrum_x, w.spectrum_y };
+  for( int axis=0; axis < 2; ++axis )
+  {
+    evbuffer_add_printf( frames, "%s\"%s\":[", axis ? "," : "", names[axis] );
+    for( size_t bin=0; bin < SWAY_BINS; ++bin )
+    {
+      evbuffer_add_printf( frames, bin ? ",%.4f" : "%.4f",
+                           spectra[axis][bin] );
+    }
+    evbuffer_add_printf( frames, "]" );
+  }
+  evbuffer_add_printf( frames, "}\n\n" );
+}
+
+void LiveStream::StreamCallback( evhtp_request_t *req, void *arg )
+{
+  auto stream = static_cast<LiveStream*>( arg );
+
+  double rate = stream->options_.default_rate;
+  const char *rate_arg = req->uri->query ?
+    evhtp_kv_find( req->uri->query, "rate" ) : nullptr;
+  if( rate_arg )
+  {
+    // NaN would get through the clamp below, and infinity means nothing
+    double asked = atof( rate_arg );
+    rate = isfinite( asked ) ? asked : rate;
+  }
+  rate = min( max( rate, 0.1 ), stream->options_.max_rate );
+  const char *format = req->uri->query ?
+    evhtp_kv_find( req->uri->query, "format" ) : nullptr;
+  bool binary = format && strcmp( format, "binary" ) == 0;
+  const char *device = req->uri->query ?
+    evhtp_kv_find( req->uri->query, "device" ) : nullptr;
+
+  // Runs on the thread serving the connection, which owns everything below
+  evhtp_connection_t *conn = evhtp_request_get_connection( req );
+  auto sub = new Subscriber{ stream, req, nullptr, stream->samples_.NewReader(),
+                             stream->events_.NewReader(),
+                             stream->sways_.NewReader(), evbuffer_new(), {},
+                             {}, device ? atol( device ) : -1, binary };
+  sub->timer = event_new( conn->evbase, -1, EV_PERSIST, TickCallback, sub );
+  long interval_us = long( 1e6 / rate );
+  timeval interval = { interval_us / 1000000, interval_us % 1000000 };
+  event_add( sub->timer, &interval );
+  // Hooks are stored untyped, void (*)() is the sanctioned way there
+  evhtp_request_set_hook( req, evhtp_hook_on_request_fini,
+                          (evhtp_hook)(void (*)()) FinishedCallback, sub );
+
+  evhtp_headers_add_header( req->headers_out,
+      evhtp_header_new( "Content-Type", binary ? "application/octet-stream" :
+                        "text/event-stream", 0, 0 ));
+  evhtp_headers_add_header( req->headers_out,
+      evhtp_header_new( "Cache-Control", "no-cache", 0, 0 ));
+  evhtp_send_reply_chunk_start( req, EVHTP_RES_OK );
+
+  size_t count = ++stream->subscribers_;
+  INFO( "Live stream {} subscriber at {:.1f} Hz, {} connected",
+        binary ? "binary" : "text", rate, count );
+}
+
+void LiveStream::TickCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  auto sub = static_cast<Subscriber*>( arg );
+
+  // Keep only the newest sample of each board, whether or not it can go out
+  // this tick.  There are only ever a few boards.
+  LiveSample samples[64];
+  size_t count;
+  while( (count = sub->samples.Read( samples, 64 )) > 0 )
+  {
+    for( size_t idx=0; idx < count; ++idx )
+    {
+      const LiveSample &sample = samples[idx];
+      if( sub->device >= 0 && sample.device != uint32_t( sub->device ))
+      {
+        continue;
+      }
+      if( Coalesce( sample, &sub->latest ))
+      {
+        ++sub->stream->coalesced_;
+      }
+    }
+  }
+  LiveSway sway;
+  while( sub->sways.Read( &sway, 1 ) > 0 )
+  {
+    if( sub->device < 0 || sway.device == uint32_t( sub->device ))
+    {
+      Coalesce( sway, &sub->latest_sway );
+    }
+  }
+
+  evhtp_connection_t *conn = evhtp_request_get_connection( sub->req );
+  evbuffer *unsent = bufferevent_get_output( conn->bev );
+  if( evbuffer_get_length( unsent ) > sub->stream->options_.high_water )
+  {
+    return;
+  }
+
+  // Latency is taken as frames are queued, they go out with this tick
+  Metrics &metrics = GlobalMetrics();
+  LiveEvent live;
+  while( sub->events.Read( &live, 1 ) > 0 )
+  {
+    if( sub->device >= 0 && live.device != uint32_t( sub->device ))
+    {
+      continue;
+    }
+    const SettleEvent &event = live.event;
+    metrics.sample_to_client.Record( MonotonicNanos() - live.published_ns );
+    RecordSensorLatency( event.timestamp_us );
+    metrics.stream_frames.Add();
+    if( sub->binary )
+    {
+      LiveFrame frame = { 1.0 + event.type, double( event.timestamp_us ),
+                          event.weight, 0, 0, event.stddev, event.confidence,
+                          double( live.device ) };
+      evbuffer_add( sub->frames, &frame, sizeof( frame ));
+    }
+    else
+    {
+      evbuffer_add_printf( sub->frames, "event: settle\ndata: {\"device\":%u,"
+                           "\"type\":\"%s\",\"t\":%lu,\"weight\":%.3f,"
+                           "\"stddev\":%.4f,\"confidence\":%.3f}\n\n",
+                           live.device, SettleEventName( event.type ),
+                           (unsigned long) event.timestamp_us, event.weight,
+                           event.stddev, event.confidence );
+    }
+  }
+  for( const LiveSample &s : sub->latest )
+  {
+    metrics.sample_to_client.Record( MonotonicNanos() - s.published_ns );
+    RecordSensorLatency( s.timestamp_us );
+    metrics.stream_frames.Add();
+    if( sub->binary )
+    {
+      LiveFrame frame = { 0, double( s.timestamp_us ), s.weight, s.cop_x,
+                          s.cop_y, 0, 0, double( s.device ) };
+      evbuffer_add( sub->frames, &frame, sizeof( frame ));
+    }
+    else
+    {
+      evbuffer_add_printf( sub->frames, "event: sample\ndata: {\"device\":%u,"
+                           "\"t\":%lu,\"weight\":%.3f,\"cop_x\":%.2f,"
+                           "\"cop_y\":%.2f}\n\n",
+                           s.device, (unsigned long) s.timestamp_us, s.weight,
+                           s.cop_x, s.cop_y );
+    }
+  }
+  sub->latest.clear();
+  for( const LiveSway &live_sway : sub->latest_sway )
+  {
+    const SwayMetrics &w = live_sway.sway;
+    metrics.sample_to_client.Record( MonotonicNanos() -
+                                     live_sway.published_ns );
+    metrics.stream_frames.Add();
+    if( sub->binary )
+    {
+      LiveFrame frame = { 4, double( w.timestamp_us ), w.path_length, w.rms,
+                          w.ellipse_area, w.mean_velocity, w.mean_frequency,
+                          double( live_sway.device ) };
+      evbuffer_add( sub->frames, &frame, sizeof( frame ));
+    }
+    else
+    {
+      AddSwayEvent( live_sway, sub->frames );
+    }
+  }
+  sub->latest_sway.clear();
+
+  if( evbuffer_get_length( sub->frames ) > 0 )
+  {
+    evhtp_send_reply_chunk( sub->req, sub->frames );
+    evbuffer_drain( sub->frames, evbuffer_get_length( sub->frames ));
+  }
+}
+
+evhtp_res LiveStream::FinishedCallback( evhtp_request_t *req, void *arg )
+{
+  (void) req;
+  auto sub = static_cast<Subscriber*>( arg );
+  size_t count = --sub->stream->subscribers_;
+  INFO( "Live stream subscriber left, {} connected", count );
+  event_free( sub->timer );
+  evbuffer_free( sub->frames );
+  delete sub;
+  return EVHTP_RES_OK;
+}
@@ -4,29 +4,52 @@
 
 #include "logging.h"
 
-std::shared_ptr<spdlog::logger> Log() {
-  static std::shared_ptr<spdlog::logger> log = []() {
-    auto log = spdlog::get("console");
-    if (!log) {
-      // By default log to stdout
-      log = spdlog::stdout_logger_st("console", true);
-      log->set_pattern("[%Y%m%d %H:%M:%S.%e] %l | %v");
-      log->info("Logging to default console");
-
-      char* log_level_raw = getenv("LOGLEVEL");
-      if (log_level_raw)
-      {
-        std::string log_level = pystring::lower(std::string{log_level_raw});
-        if      (log_level == "debug") { log->set_level(spdlog::level::debug); }
-        else if (log_level == "info")  { log->set_level(spdlog::level::info ); }
-        else if (log_level == "warn")  { log->set_level(spdlog::level::warn ); }
-        else if (log_level == "error") { log->set_level(spdlog::level::err  ); }
-        else                           { }
-      }
-    }
-    return log;
-  }();
-
-  return log;
+void StartLogging( const LogOptions &options )
+{
+  if( spdlog::get( "console" ))
+  {
+    return;
+  }
+
+  if( options.async )
+  {
+    spdlog::set_async_mode( options.queue_size, options.block_when_full ?
+        spdlog::async_overflow_policy::block_retry :
+        spdlog::async_overflow_policy::discard_log_msg, nullptr,
+        std::chrono::milliseconds( 500 ));
+  }
+
+  // Only the async worker writes to the sink, but synchronous callers may be
+  // on any thread
+  auto log = options.async ? spdlog::stdout_logger_st( "console", true ) :
+    spdlog::stdout_logger_mt( "console", true );
+  spdlog::set_sync_mode();
+
+  log->set_pattern("[%Y%m%d %H:%M:%S.%e] %l | %v");
+  log->flush_on( spdlog::level::err );
+
+  char* log_level_raw = getenv("LOGLEVEL");
+  if (log_level_raw)
+  {
+    std::string log_level = pystring::lower(std::string{log_level_raw});
+    if      (log_level == "debug") { log->set_level(spdlog::level::debug); }
+    else if (log_level == "info")  { log->set_level(spdlog::level::info ); }
+    else if (log_level == "warn")  { log->set_level(spdlog::level::warn ); }
+    else if (log_level == "error") { log->set_level(spdlog::level::err  ); }
+    else                           { }
+  }
+  log->info( "Logging to default console{}", options.async ? " (async)" : "" );
 }
 
+spdlog::logger* CreateLog ()
+{
+  if( !spdlog::get( "console" ))
+  {
+    // Nobody set logging up, log synchronously to stdout
+    LogOptions options;
+    options.async = false;
+    StartLogging( options );
+  }
+  // The registry keeps the logger alive
+  return spdlog::get( "console" ).get();
+}
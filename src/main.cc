@@ -1,205 +1,109 @@
 #include <cassert>
-#include <poll.h>
+#include <cmath>
 #include <signal.h>
 
-#include <experimental/filesystem>
-#include <fstream>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <string>
-#include <thread>
 #include <vector>
 
 #include <Eigen/Dense>
 #include <event2/event.h>
-#include <nanomsg/nn.h>
-#include <nanomsg/pair.h>
-#include <nanomsg/reqrep.h>
-#include <nanomsg/ws.h>
 #include <sqlite3.h>
-#include <xwiimote.h>
 
 #include <argh.h>
-#include <evhtp.h>
 #include <json.hpp>
 #include <sqlite_modern_cpp.h>
 
+#include "api_dispatcher.h"
+#include "api_socket.h"
+#include "calibration.h"
+#include "convert.h"
+#include "device_manager.h"
+#include "history_export.h"
+#include "http_server.h"
+#include "live_stream.h"
 #include "logging.h"
+#include "measurement_store.h"
+#include "metrics.h"
+#include "rollups.h"
+#include "sensor_source.h"
+#include "settle_detector.h"
+#include "sway_analyzer.h"
+#include "thread_pool.h"
+#include "user_registry.h"
 
 using namespace std;
 using namespace Eigen;
 using json = nlohmann::json;
-namespace fs = std::experimental::filesystem;
 
 #define CHECKSQL(X, db, msg) do { int rc = X; if( rc != SQLITE_OK ) { \
   FATAL( "{}: {}", msg, sqlite3_errmsg( db )); }} while(0)
 
 static constexpr const char *DATABASE = "/tmp/db.sqlite";
-static bool s_should_quit = false;
 
-static xwii_iface* WaitForBalanceBoard ()
+static void HandleBalanceBoard( uint32_t device, const RawSample &sample,
+                                double weight )
 {
-  auto monitor = xwii_monitor_new( true, false );
+  fmt::print( "[{}] {:6.2f} <== {:6.2f} {:6.2f} {:6.2f} {:6.2f}  ",
+       device, weight,
+       sample.corners[TOP_LEFT] * RAW_TO_POUNDS,
+       sample.corners[TOP_RIGHT] * RAW_TO_POUNDS,
+       sample.corners[BOTTOM_LEFT] * RAW_TO_POUNDS,
+       sample.corners[BOTTOM_RIGHT] * RAW_TO_POUNDS );
+}
 
-  int fd = ::xwii_monitor_get_fd( monitor, true );
-  if( fd == -1 )
+// Terminal display.  Batches only note each board's latest sample; a timer
+// on the loop shows them ten times a second, so terminal I/O never sits on
+// the sensor path.
+struct Display
+{
+  struct Latest
   {
-    FATAL( "XWii FD is invalid" );
-  }
-
-  INFO( "Connected to devices" );
-  char *dev_path;
-  string dev_name;
-  while( (dev_path = ::xwii_monitor_poll( monitor )) != nullptr ) {
-    INFO( "{}", dev_path );
-
-    ::xwii_iface *dev;
-    if( ::xwii_iface_new( &dev, dev_path ) < 0 )
-    {
-      FATAL( "Couldn't create interface for {}", dev_path );
-    }
-
-    char *dev_type;
-    if( ::xwii_iface_get_devtype( dev, &dev_type ) < 0 )
-    {
-      FATAL( "Couldn't get devtype for {}", dev_path );
-    }
-    dev_name = dev_type;
-    free( dev_type );
-    free( dev_path );
-
-    INFO( " is a {}", dev_name );
+    RawSample sample;
+    double weight;
+    bool fresh;
+  };
+  map<uint32_t, Latest> boards;
 
-    if( dev_name == "balanceboard" )
+  void Update( uint32_t device, const RawBatch &raw,
+               const ConvertedBatch &converted )
+  {
+    size_t last = raw.Size() - 1;
+    RawSample sample{ raw.timestamp_us[last], { 0, 0, 0, 0 } };
+    for( int i=0; i < 4; ++i )
     {
-      return dev;
+      sample.corners[i] = raw.corners[i][last];
     }
+    boards[device] = Latest{ sample, converted.weight[last], true };
   }
+};
 
-  ::xwii_monitor_unref( monitor );
-
-  FATAL( "No balance boards connected" );
-
-  return nullptr;
-}
-
-static void HandleBalanceBoard( const ::xwii_event &event,
-                               const VectorXd &coefs )
-{
-//        tl = event.get_abs(2)[0]
-//        tr = event.get_abs(0)[0]
-//        br = event.get_abs(3)[0]
-//        bl = event.get_abs(1)[0]
-  Eigen::Vector4d values;
-  values <<
-    event.v.abs[0].x, event.v.abs[1].x, event.v.abs[2].x, event.v.abs[3].x;
-
-  values = values / 100.0 * 2.20462;
-  double weight = values.sum();
-  weight = coefs[0]*weight*weight + coefs[1]*weight + coefs[2];
-
-  fmt::print( "Values: {:6.2f} <== {:6.2f} {:6.2f} {:6.2f} {:6.2f}\r",
-       weight, values[0], values[1], values[2], values[3] );
-  std::cout << std::flush;
-}
-
-VectorXd GetCalibrationCoefficients ( sqlite::database &db )
+static void DisplayCallback( evutil_socket_t fd, short what, void *arg )
 {
-  vector<double> scale_values_raw;
-  vector<double> wii_values_raw;
-
-  db << "SELECT scale, wii FROM calibration;"
-    >> [&]( double scale, double wii ) {
-      scale_values_raw.push_back( scale );
-      wii_values_raw.push_back( wii );
-    };
-
-  VectorXd scale_values{ scale_values_raw.size() };
-  VectorXd wii_values{ wii_values_raw.size() };
-
-  for( size_t idx=0; idx < scale_values_raw.size(); ++idx )
+  (void) fd;
+  (void) what;
+  auto display = static_cast<Display*>( arg );
+  bool fresh = false;
+  for( const auto &board : display->boards )
   {
-    scale_values( idx ) = scale_values_raw[ idx ];
-    wii_values( idx ) = wii_values_raw[ idx ];
+    fresh = fresh || board.second.fresh;
   }
-
-  // Compute calibration coefficients
-  MatrixXd A = MatrixXd::Ones( scale_values.rows(), 3 );
-  A.col(0) = wii_values.asDiagonal()*wii_values;
-  A.col(1) = wii_values;
-
-  return (A.adjoint() * A).llt().solve( A.adjoint() * scale_values );
-}
-
-static VectorXd Sample( sqlite::database &db, ::xwii_iface *iface, int num )
-{
-  ::xwii_event event;
-  int ret = 0;
-  int fds_num;
-  struct pollfd fds[2];
-
-  memset(fds, 0, sizeof(fds));
-  fds[0].fd = 0;
-  fds[0].events = POLLIN;
-  fds[1].fd = ::xwii_iface_get_fd(iface);
-  fds[1].events = POLLIN;
-  fds_num = 2;
-
-  ret = xwii_iface_watch(iface, true);
-  if (ret)
+  if( !fresh )
   {
-    ERROR("Cannot initialize hotplug watch descriptor");
-  }
-
-  VectorXd coefs = GetCalibrationCoefficients( db );
-
-  vector<double> raw_weights;
-  while (num--) {
-    ret = poll(fds, fds_num, -1);
-    if (ret < 0) {
-      if (errno != EINTR) {
-        ret = -errno;
-        ERROR("Cannot poll fds: {}", ret);
-        break;
-      }
-    }
-
-    ret = xwii_iface_dispatch(iface, &event, sizeof(event));
-    if (ret)
-    {
-      if (ret != -EAGAIN)
-      {
-        ERROR("Read failed with err: {}", ret);
-        break;
-      }
-    }
-
-    if( event.type == XWII_EVENT_BALANCE_BOARD )
-    {
-      Eigen::Vector4d values;
-      values <<
-        event.v.abs[0].x, event.v.abs[1].x, event.v.abs[2].x, event.v.abs[3].x;
-
-      values = values / 100.0 * 2.20462;
-      double weight = values.sum();
-      weight = coefs[0]*weight*weight + coefs[1]*weight + coefs[2];
-
-      raw_weights.push_back( weight );
-
-      fmt::print( "Values: {:6.2f} <== {:6.2f} {:6.2f} {:6.2f} {:6.2f}\r",
-                 weight, values[0], values[1], values[2], values[3] );
-      std::cout << std::flush;
-
-      HandleBalanceBoard( event, coefs );
-    }
+    return;
   }
 
-  VectorXd weights( raw_weights.size() );
-  for( size_t i=0; i < raw_weights.size(); ++i )
+  fmt::print( "Values: " );
+  for( auto &board : display->boards )
   {
-    weights(i) = raw_weights[i];
+    HandleBalanceBoard( board.first, board.second.sample, board.second.weight );
+    board.second.fresh = false;
   }
-
-  return weights;
+  fmt::print( "\r" );
+  std::cout << std::flush;
 }
 
 void LoadDefaultCalibration ( sqlite::database &db )
@@ -219,6 +123,7 @@ void LoadDefaultCalibration ( sqlite::database &db )
     WARN( "Missing calibration data, loading default values." );
   }
 
+  db << "BEGIN;";
   db << "DROP TABLE IF EXISTS calibration;";
   db << "CREATE TABLE calibration( "
     "id INTEGER PRIMARY KEY,"
@@ -231,17 +136,19 @@ void LoadDefaultCalibration ( sqlite::database &db )
     165.2, 135.6 };
   assert( scale_values.size() == wii_values.size() );
 
+  auto insert = db << "INSERT INTO calibration (scale, wii) values (?, ?);";
+  insert.used( true );
   for( size_t idx=0; idx < scale_values.size(); ++idx )
   {
-    db << "INSERT INTO calibration (scale, wii) values (?, ?);"
-      << scale_values[idx]
-      << wii_values[idx];
+    insert << scale_values[idx] << wii_values[idx];
+    insert++;
   }
+  db << "COMMIT;";
 }
 
-sqlite::database Sqlite()
+sqlite::database Sqlite( const string &path )
 {
-  sqlite::database db( DATABASE );
+  auto db = OpenTunedDatabase( path );
   string version;
   db << "SELECT SQLITE_VERSION();"
     >> []( string version ) {
@@ -250,195 +157,394 @@ sqlite::database Sqlite()
   return db;
 }
 
-struct Header
+// Picks the sensor backend from the command line:
+//   --replay=<log> [--speed=<x>]  play a recorded log back, speed 0 is flat out
+//   --record=<log>                append whatever is read to a log, one log
+//                                 per board at <log>.<device> for live boards
+//   --simulate=<n> [--sim_rate=<hz>]
+//                                 n made-up boards for load tests, rate 0 is
+//                                 flat out
+//   --reader_cpu=<n>              read a replay or simulated boards on
+//                                 threads pinned to cpu n
+// and otherwise watches for live balance boards.
+static void OpenSensors ( const argh::parser &cmdl, DeviceManager &devices )
 {
-  string key;
-  string value;
-};
+  string record_path;
+  bool record = bool( cmdl( "record" ) >> record_path );
 
-void RootCallback( evhtp_request_t *req, void *data )
-{
-  (void) data;
+  int reader_cpu;
+  cmdl( "reader_cpu", -1 ) >> reader_cpu;
 
-  if( req->uri->path->full )
+  int simulate;
+  if( cmdl( "simulate" ) >> simulate )
   {
-    INFO( "Got a request for '{}'", req->uri->path->full );
-  }
-  else
-  {
-    INFO( "Unknown query" );
-    evhtp_send_reply( req, EVHTP_RES_NOTFOUND );
+    double rate;
+    cmdl( "sim_rate", 100.0 ) >> rate;
+    for( int board=0; board < simulate; ++board )
+    {
+      devices.Attach( fmt::format( "sim:{}", board ), unique_ptr<SensorSource>(
+          new SimulatedSource( uint32_t( board ), rate )), reader_cpu );
+    }
     return;
   }
 
-  string response = R"(
-  <html>
-  <head>
-  <title>Unknown Resource</title>
-  </head>
-  <body>
-  <h1>Unknown Resource</h1>
-  <p><a href="/">Go Home</a></p>
-  </body>
-  </html>
-  )";
-
-  fs::path file_path{ "."s + req->uri->path->full };
-  if( file_path == fs::path( "./" ))
+  string replay_path;
+  if( !( cmdl( "replay" ) >> replay_path ))
   {
-    file_path = { "./index.html" };
+    if( record )
+    {
+      devices.Record( record_path );
+    }
+    devices.Watch();
+    return;
   }
 
-  if( fs::exists( file_path ) && fs::is_regular_file( file_path ))
-  {
-    ifstream file_in{ file_path };
-    ostringstream buf;
-    buf << file_in.rdbuf();
-    response = buf.str();
-  }
-  else
+  double speed;
+  cmdl( "speed", 1.0 ) >> speed;
+  unique_ptr<SensorSource> source( new ReplaySource( replay_path, speed ));
+  if( record )
   {
-    WARN( "Unknown path '{}', using default message", file_path );
+    source.reset( new RecordingSource( move( source ), record_path ));
   }
 
-  evbuffer_add( req->buffer_out, response.c_str(), response.size() );
+  devices.Attach( "replay:" + replay_path, move( source ), reader_cpu );
+}
 
-  Header headers[] = {
-    { "Content-Type", "text/html" },
-    { "Content-Language", "en" }
-  };
-  for( const auto& header : headers )
+static json HistoryResponse( const json &j, sqlite::database &db )
+{
+  // {"user_id": n, "start_us": t0, "end_us": t1, "points": max points}
+  vector<HistoryPoint> points;
+  string tier = QueryHistory( db, j.at( "user_id" ), j.at( "start_us" ),
+                              j.at( "end_us" ), j.value( "points", 500 ),
+                              &points );
+
+  json history = json::array();
+  for( const auto &point : points )
   {
-    evhtp_headers_add_header( req->headers_out, evhtp_header_new(
-            header.key.c_str(), header.value.c_str(), 1, 1 ));
+    history.push_back( {
+        { "t", point.timestamp_us },
+        { "count", point.stats.count },
+        { "min", point.stats.min },
+        { "max", point.stats.max },
+        { "mean", point.stats.mean },
+        { "variance", point.stats.Variance() } } );
   }
 
-  evhtp_send_reply( req, EVHTP_RES_OK );
+  json r;
+  r["response"] = "history";
+  r["tier"] = tier;
+  r["points"] = history;
+  return r;
 }
 
+static json SwaySessionsResponse( const json &j, sqlite::database &db )
+{
+  // {"user_id": n (all users if absent), "start_us": t0, "end_us": t1,
+  //  "limit": max sessions}
+  auto sessions = QuerySwaySessions( db, j.value( "user_id", int64_t( -1 )),
+                                     j.value( "start_us", uint64_t( 0 )),
+                                     j.value( "end_us", uint64_t( INT64_MAX )),
+                                     j.value( "limit", size_t( 100 )));
+  json r;
+  r["response"] = "sway_sessions";
+  r["sessions"] = json::array();
+  for( const auto &s : sessions )
+  {
+    r["sessions"].push_back( {
+        { "id", s.id },
+        { "device", s.device },
+        { "user_id", s.user_id },
+        { "start_us", s.start_us },
+        { "end_us", s.end_us },
+        { "samples", s.samples },
+        { "weight", s.weight },
+        { "path_length", s.path_length },
+        { "mean_velocity", s.mean_velocity },
+        { "rms", s.rms },
+        { "ellipse_area", s.ellipse_area },
+        { "mean_frequency", s.mean_frequency } } );
+  }
+  return r;
+}
 
-void SigintHandler( evutil_socket_t fd, short event, void *arg )
+static json UserJson( const UserRegistry &users, const User &user )
 {
-  (void) fd;
-  (void) event;
-  evbase_t *evbase =  reinterpret_cast<evbase_t*>( arg );
-  INFO( "Got SIGINT" );
-  s_should_quit = true;
-  event_base_loopbreak( evbase );
+  // Board timestamps are input event times, which are wall clock
+  uint64_t now_us = chrono::duration_cast<chrono::microseconds>(
+    chrono::system_clock::now().time_since_epoch() ).count();
+  return {
+    { "id", user.id },
+    { "name", user.name },
+    { "age", user.age },
+    { "weight", users.Expected( user.id, now_us ) },
+    { "reference_weight", user.weight } };
 }
 
-void HttpLoop ()
+static json UsersResponse( const UserRegistry &users )
 {
-  evbase_t *evbase = event_base_new();
-  evhtp_t *htp = evhtp_new( evbase, nullptr );
-  evhtp_set_glob_cb( htp, "*", RootCallback, nullptr );
-
-  evhtp_bind_socket( htp, "0.0.0.0", 8080, 2048 );
-
-  event *signal_int = evsignal_new( evbase, SIGINT, SigintHandler, evbase );
-  event_add( signal_int, nullptr );
-  INFO( "Started HTTP server on port 8080" );
-  event_base_loop( evbase, 0 );
-
-  evhtp_unbind_socket( htp );
-  event_free( signal_int );
-  evhtp_free( htp );
-  event_base_free( evbase );
-  INFO( "Stopped HTTP server" );
+  json all = json::array();
+  for( const auto &user : users.All() )
+  {
+    all.push_back( UserJson( users, user ));
+  }
+
+  json r;
+  r["response"] = "all_users";
+  r["users"] = all;
+  return r;
 }
 
-int main(int argc, char **argv) {
-  // DELETE THESE.  Used to suppress unused variable warnings.
-  (void)argc;
-  (void)argv;
+// {"name": s, "age": n, "weight": reference lbs}, plus "id" for an update
+static json UserResponse( UserRegistry &users, const json &j, bool update )
+{
+  User user;
+  if( update )
+  {
+    int64_t id = j.at( "id" );
+    auto existing = users.Find( id );
+    if( !existing )
+    {
+      throw runtime_error( fmt::format( "no user {}", id ));
+    }
+    user = *existing;
+  }
+  user.name = j.value( "name", user.name );
+  user.age = j.value( "age", user.age );
+  user.weight = j.value( "weight", user.weight );
 
-  int socket = nn_socket( AF_SP, NN_REP );
-  if( socket < 0 )
+  if( update )
   {
-    ERROR( "nn_socket failed: {}", nn_strerror( nn_errno() ));
-    return -1;
+    users.Update( user );
   }
-  int opt = NN_WS_MSG_TYPE_TEXT;
-  //nn_setsockopt( socket, NN_WS, NN_WS_MSG_TYPE, &opt, sizeof(opt) );
-  opt = 500;
-  nn_setsockopt( socket, NN_SOL_SOCKET, NN_SNDTIMEO, &opt, sizeof(opt) );
-  int endpoint_id = nn_bind( socket, "ws://*:8081" );
-  if( endpoint_id < 0 )
+  else
   {
-    ERROR( "nn_bind failed: {}", nn_strerror( nn_errno() ));
-    return -1;
+    user.id = users.Add( user.name, user.age, user.weight );
   }
 
-  INFO( "Started NN WebSocket on port 8081" );
-
-  thread http_thread( HttpLoop );
+  json r;
+  r["response"] = "user";
+  r["user"] = UserJson( users, user );
+  return r;
+}
 
-  while( 1 )
+static json AddCalibrationResponse( Calibrator &calibrator, const json &j )
+{
+  // {"scale": <reference lbs>, "wii": <board lbs>} or, for the per-corner
+  // model, "corners": [four corner readings in lbs]
+  double scale = j.at( "scale" );
+  if( j.count( "corners" ))
   {
-    char *buf = nullptr;
-    INFO( "Waiting on message" );
-    int bytes = nn_recv( socket, &buf, NN_MSG, 0 );
-    if( bytes >= 0 )
+    Vector4d corners;
+    for( int i=0; i < 4; ++i )
     {
-      // Enforce c-string
-      if( buf[bytes-1] != '\0' ) { buf[bytes-1] = '\0'; }
-      auto j = json::parse( buf );
-      nn_freemsg( buf );
+      corners[i] = j.at( "corners" ).at( i );
+    }
+    calibrator.AddCornerPoint( scale, corners );
+  }
+  else
+  {
+    calibrator.AddPoint( scale, j.at( "wii" ));
+  }
 
-      json r;
-      string request = j["request"];
-      if( request == "get_users" )
-      {
-        json users;
-        json user;
-        user["name"] = "jim";
-        user["age"] = 33;
-        user["weight"] = 185;
-        user["id"] = 1;
-        users.push_back( user );
-
-        r["response"] = "all_users";
-        r["users"] = users;
-      }
+  auto model = calibrator.Current();
+  json r;
+  r["response"] = "calibration";
+  r["version"] = model->version;
+  r["coefs"] = { model->coefs[0], model->coefs[1], model->coefs[2] };
+  r["per_corner"] = model->per_corner;
+  return r;
+}
 
-      string response = r.dump();
-      bytes = nn_send( socket, response.c_str(), response.size()+1, 0 );
-      if( bytes < 0 )
+// The websocket API.  History and recalibration go to the pool so they
+// never hold up the cheap requests.
+static void RegisterRequests( ApiDispatcher &api, DeviceManager &devices,
+                              UserRegistry &users, MeasurementStore &store,
+                              const ThreadPool &pool,
+                              const LiveStream &stream,
+                              const ApiSocket &socket )
+{
+  api.On( "get_users", [&users]( const json &j ) {
+      (void) j;
+      return UsersResponse( users );
+    });
+  api.On( "add_user", [&users]( const json &j ) {
+      return UserResponse( users, j, false );
+    });
+  api.On( "update_user", [&users]( const json &j ) {
+      return UserResponse( users, j, true );
+    });
+  api.On( "delete_user", [&users]( const json &j ) {
+      json r;
+      r["response"] = "user_deleted";
+      r["id"] = j.at( "id" );
+      r["deleted"] = users.Remove( j.at( "id" ));
+      return r;
+    });
+  // Calibration requests take an optional "device", the shared profile if
+  // left out
+  api.On( "add_calibration", [&devices]( const json &j ) {
+      uint32_t device = j.value( "device", 0 );
+      json r = AddCalibrationResponse( devices.CalibrationFor( device ), j );
+      if( device == 0 )
       {
-        WARN( "nn_send??: {}", nn_strerror( nn_errno() ));
+        devices.SharedCalibrationChanged();
       }
-      else
+      r["device"] = device;
+      return r;
+    });
+  api.OnPool( "get_history", HistoryResponse );
+  api.OnPool( "get_sway_sessions", SwaySessionsResponse );
+  api.OnPool( "recalibrate_history", [&devices, &store](
+        const json &j, sqlite::database &db ) {
+      (void) db;
+      // The shared profile's rows are those of every board still using it
+      uint32_t device = j.value( "device", 0 );
+      auto model = devices.CalibrationFor( device ).Current();
+      vector<uint32_t> rewrite = device == 0 ?
+        devices.SharedProfileDevices() : vector<uint32_t>{ device };
+      json r;
+      r["response"] = "recalibrated";
+      r["device"] = device;
+      r["devices"] = rewrite;
+      r["rows"] = store.Recalibrate( rewrite, *model );
+      return r;
+    });
+  api.On( "get_status", [&api, &devices, &store, &pool, &stream, &socket](
+        const json &j ) {
+      (void) j;
+      json r;
+      r["response"] = "status";
+      r["store"] = {
+        { "queue_depth", store.QueueDepth() },
+        { "committed", store.Committed() },
+        { "batches", store.Batches() },
+        { "dropped", store.Dropped() } };
+      r["api"] = {
+        { "handled", api.Handled() },
+        { "failed", api.Failed() },
+        { "in_flight", socket.InFlight() },
+        { "pool_pending", pool.Pending() } };
+      r["stream"] = {
+        { "subscribers", stream.Subscribers() },
+        { "coalesced", stream.Coalesced() } };
+      r["devices"] = json::array();
+      for( const auto &device : devices.Stats() )
       {
-        INFO( "Sent reply: {}", response );
+        r["devices"].push_back( {
+            { "id", device.id },
+            { "address", device.address },
+            { "connected", device.connected },
+            { "samples", device.samples },
+            { "dropped", device.dropped },
+            { "reconnects", device.reconnects },
+            { "rate", device.rate } } );
       }
+      return r;
+    });
+}
 
-    }
-    else
-    {
-      break;
-    }
+int main(int argc, char **argv) {
+  argh::parser cmdl( argc, argv );
+
+  // Logging is queued to a background writer unless --sync_log
+  LogOptions log_options;
+  log_options.async = !cmdl[ "sync_log" ];
+  cmdl( "log_queue", log_options.queue_size ) >> log_options.queue_size;
+  StartLogging( log_options );
+
+  // --db, --http_port and --api_url let a second instance, such as one a
+  // benchmark starts, run beside the real one
+  string database;
+  cmdl( "db", DATABASE ) >> database;
+  auto db = Sqlite( database );
+  LoadDefaultCalibration( db );
+  MeasurementStore store( database );
+  UserRegistry users( db );
+
+  // Outlive the HTTP server, whose threads serve their clients
+  LiveStream live_stream;
+  HistoryExport history_export;
+
+  // One loop, evhtp's, drives page loads, the websocket API and the sensor.
+  // Only slow API requests leave it, for the thread pool.
+  HttpServer::Options http_options;
+  cmdl( "http_threads", 0 ) >> http_options.threads;
+  cmdl( "http_port", http_options.port ) >> http_options.port;
+  http_options.database = database;
+  HttpServer http( http_options );
+  http.OnSignal( SIGINT, [&http]() {
+      INFO( "Got SIGINT" );
+      http.Stop();
+    });
+  http.AddHandler( "/stream", LiveStream::StreamCallback, &live_stream );
+  http.AddHandler( "/export", HistoryExport::ExportCallback, &history_export );
+  http.AddHandler( "/metrics", Metrics::MetricsCallback, &GlobalMetrics() );
+
+  int pool_threads;
+  cmdl( "pool_threads", 2 ) >> pool_threads;
+  ThreadPool pool( http.Base(), pool_threads, database );
+  SwaySessionLog sway_log( db, pool );
+
+  string api_url;
+  cmdl( "api_url", "ws://*:8081" ) >> api_url;
+  ApiDispatcher api( pool );
+  ApiSocket api_socket( http.Base(), api_url, [&api, &api_socket](
+        uint64_t id, const string &message ) {
+      api.Dispatch( message, [&api_socket, id]( const string &reply ) {
+          api_socket.Reply( id, reply );
+        });
+    });
+  // Every board gets its own pipeline, all of them read on the loop
+  DeviceManager devices( http.Base(), db, store );
+  RegisterRequests( api, devices, users, store, pool, live_stream,
+                    api_socket );
+
+  Display display;
+  devices.OnEvent( [&live_stream]( uint32_t device,
+                                   const SettleEvent &event ) {
+      live_stream.Publish( device, event );
+      INFO( "Device {} {}: {:.2f} lbs (stddev {:.3f}, confidence {:.2f})",
+            device, SettleEventName( event.type ), event.weight,
+            event.stddev, event.confidence );
+    });
+  devices.Identify( [&users]( uint64_t timestamp_us, double weight ) {
+      int64_t user_id = users.Attribute( timestamp_us, weight );
+      INFO( "Weighing of {:.2f} lbs attributed to user {}", weight, user_id );
+      return user_id;
+    });
+  devices.OnSway( [&live_stream]( uint32_t device, const SwayMetrics &sway ) {
+      live_stream.Publish( device, sway );
+    });
+  devices.OnSession( [&sway_log]( const SwaySession &session ) {
+      sway_log.Add( session );
+      INFO( "Device {} sway over {:.1f} s: path {:.0f} mm, rms {:.2f} mm, "
+            "ellipse {:.0f} mm^2", session.device,
+            ( session.end_us - session.start_us ) / 1e6, session.path_length,
+            session.rms, session.ellipse_area );
+    });
+  devices.OnBatch( [&live_stream, &display]( uint32_t device,
+                                             const RawBatch &raw,
+                                             const ConvertedBatch &converted ) {
+      live_stream.Publish( device, raw, converted );
+      display.Update( device, raw, converted );
+    });
+  try
+  {
+    OpenSensors( cmdl, devices );
   }
-
-  http_thread.join();
-  INFO( "Goodbye, user" );
-  return 0;
-
-  auto iface = WaitForBalanceBoard();
-
-  uint64_t available_types = xwii_iface_available( iface );
-  INFO( "Available types: {:x}", available_types );
-
-  int ret =
-    xwii_iface_open( iface, available_types | XWII_IFACE_BALANCE_BOARD );
-
-  if( ret != 0 )
+  catch( const exception &e )
   {
-    FATAL( "Can't open interface" );
-  };
+    WARN( "Running without a sensor: {}", e.what() );
+  }
 
-  auto db = Sqlite();
-  LoadDefaultCalibration( db );
-  Sample( db, iface, 100 );
+  const timeval display_interval = { 0, 100000 };
+  event *display_timer = event_new( http.Base(), -1, EV_PERSIST,
+                                    DisplayCallback, &display );
+  event_add( display_timer, &display_interval );
+
+  http.Run();
 
+  event_free( display_timer );
+  INFO( "Goodbye, user" );
   return 0;
 }
@@ -0,0 +1,244 @@
+#include <chrono>
+#include <cmath>
+
+#include "convert.h"
+#include "logging.h"
+#include "measurement_store.h"
+#include "metrics.h"
+#include "rollups.h"
+
+using namespace std;
+
+// Rows per transaction when rewriting history
+static constexpr size_t RECALIBRATE_CHUNK = 4096;
+
+sqlite::database OpenTunedDatabase( const string &path )
+{
+  sqlite::database db( path );
+  db << "PRAGMA busy_timeout = 5000;";
+  db << "PRAGMA journal_mode = WAL;"
+    >> []( string mode ) {
+      if( mode != "wal" )
+      {
+        WARN( "SQLite refused WAL mode, journal is '{}'", mode );
+      }
+    };
+  db << "PRAGMA synchronous = NORMAL;";
+  db << "PRAGMA cache_size = -8192;";
+  db << "PRAGMA temp_store = MEMORY;";
+  return db;
+}
+
+MeasurementStore::MeasurementStore( const string &path )
+  : MeasurementStore( path, Options() )
+{
+}
+
+MeasurementStore::MeasurementStore( const string &path,
+                                    const Options &options )
+  : path_( path ), options_( options ), writing_{ false },
+    flush_requested_{ false }, should_stop_{ false }, committed_{ 0 },
+    dropped_{ 0 }, batches_{ 0 }
+{
+  auto db = OpenTunedDatabase( path_ );
+  db << "CREATE TABLE IF NOT EXISTS measurements( "
+    "id INTEGER PRIMARY KEY,"
+    "timestamp_us INTEGER NOT NULL,"
+    "device INTEGER NOT NULL,"
+    "user_id INTEGER NOT NULL DEFAULT 0,"
+    "weight DOUBLE,"
+    "stddev DOUBLE,"
+    "confidence DOUBLE,"
+    "cop_x DOUBLE,"
+    "cop_y DOUBLE,"
+    "c0 INTEGER, c1 INTEGER, c2 INTEGER, c3 INTEGER,"
+    "calibration INTEGER );";
+  db << "CREATE INDEX IF NOT EXISTS measurements_user_time "
+    "ON measurements( user_id, timestamp_us );";
+  CreateRollupTables( db );
+
+  queue_.reserve( options_.batch_size );
+  thread_ = thread( &MeasurementStore::Run, this );
+}
+
+MeasurementStore::~MeasurementStore ()
+{
+  {
+    lock_guard<mutex> lock( mutex_ );
+    should_stop_ = true;
+  }
+  wake_writer_.notify_one();
+  thread_.join();
+  INFO( "Measurement store committed {} rows in {} batches, dropped {}",
+        Committed(), Batches(), Dropped() );
+}
+
+bool MeasurementStore::Enqueue( const Measurement &measurement )
+{
+  size_t depth;
+  {
+    lock_guard<mutex> lock( mutex_ );
+    if( queue_.size() >= options_.max_queue )
+    {
+      ++dropped_;
+      return false;
+    }
+    queue_.push_back( measurement );
+    depth = queue_.size();
+  }
+
+  if( depth == options_.batch_size )
+  {
+    wake_writer_.notify_one();
+  }
+  return true;
+}
+
+void MeasurementStore::Flush ()
+{
+  unique_lock<mutex> lock( mutex_ );
+  flush_requested_ = true;
+  wake_writer_.notify_one();
+  flushed_.wait( lock, [this]() { return queue_.empty() && !writing_; } );
+}
+
+size_t MeasurementStore::QueueDepth () const
+{
+  lock_guard<mutex> lock( mutex_ );
+  return queue_.size();
+}
+
+void MeasurementStore::Run ()
+{
+  auto db = OpenTunedDatabase( path_ );
+  auto insert = db << "INSERT INTO measurements (timestamp_us, device, "
+    "user_id, weight, stddev, confidence, cop_x, cop_y, c0, c1, c2, c3, "
+    "calibration) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+  // Prepared statements run on destruction unless marked used
+  insert.used( true );
+
+  RollupWriter rollups( db );
+
+  vector<Measurement> batch;
+  batch.reserve( options_.batch_size );
+
+  unique_lock<mutex> lock( mutex_ );
+  while( true )
+  {
+    wake_writer_.wait_for( lock, chrono::milliseconds( options_.flush_ms ),
+        [this]() {
+          return should_stop_ || flush_requested_ ||
+            queue_.size() >= options_.batch_size;
+        });
+    flush_requested_ = false;
+
+    if( queue_.empty() )
+    {
+      flushed_.notify_all();
+      if( should_stop_ )
+      {
+        break;
+      }
+      continue;
+    }
+
+    // Swap buffers so producers keep appending while this batch commits
+    batch.swap( queue_ );
+    writing_ = true;
+    lock.unlock();
+
+    try
+    {
+      ScopedTimer timer( GlobalMetrics().db_commit );
+      db << "BEGIN;";
+      for( const auto &m : batch )
+      {
+        insert << sqlite_int64( m.timestamp_us ) << int( m.device )
+          << sqlite_int64( m.user_id ) << m.weight << m.stddev
+          << m.confidence << m.cop_x << m.cop_y
+          << m.corners[0] << m.corners[1] << m.corners[2] << m.corners[3]
+          << sqlite_int64( m.calibration );
+        insert++;
+      }
+      for( const auto &m : batch )
+      {
+        rollups.Add( m );
+      }
+      rollups.Write();
+      db << "COMMIT;";
+      committed_ += batch.size();
+      ++batches_;
+      GlobalMetrics().db_rows.Add( batch.size() );
+    }
+    catch( const sqlite::sqlite_exception &e )
+    {
+      ERROR( "Lost {} measurements: {} ({})", batch.size(), e.what(),
+             e.get_sql() );
+      dropped_ += batch.size();
+      try { db << "ROLLBACK;"; } catch( const sqlite::sqlite_exception& ) {}
+    }
+
+    batch.clear();
+    lock.lock();
+    writing_ = false;
+    if( queue_.empty() )
+    {
+      flushed_.notify_all();
+    }
+  }
+}
+
+size_t MeasurementStore::Recalibrate( const vector<uint32_t> &devices,
+                                     const CalibrationModel &model )
+{
+  auto db = OpenTunedDatabase( path_ );
+  auto update = db << "UPDATE measurements SET weight = ?, cop_x = ?, "
+    "cop_y = ?, calibration = ? WHERE id = ?;";
+  update.used( true );
+
+  // Walk each device's rows in id order a chunk at a time, converting each
+  // chunk with the batch kernel and rewriting it in one transaction.
+  vector<sqlite_int64> ids;
+  RawBatch raw;
+  ConvertedBatch converted;
+  size_t total = 0;
+  for( uint32_t device : devices )
+  {
+    sqlite_int64 last_id = 0;
+    while( true )
+    {
+      ids.clear();
+      raw.Clear();
+      db << "SELECT id, c0, c1, c2, c3 FROM measurements "
+        "WHERE device = ? AND id > ? ORDER BY id LIMIT ?;"
+        << int( device ) << last_id << int( RECALIBRATE_CHUNK )
+        >> [&]( sqlite_int64 id, int c0, int c1, int c2, int c3 ) {
+          ids.push_back( id );
+          raw.Append( RawSample{ 0, { c0, c1, c2, c3 } } );
+        };
+      if( ids.empty() )
+      {
+        break;
+      }
+
+      ConvertBatch( raw, model, &converted );
+
+      db << "BEGIN;";
+      for( size_t idx=0; idx < ids.size(); ++idx )
+      {
+        update << converted.weight[idx] << converted.cop_x[idx]
+          << converted.cop_y[idx] << sqlite_int64( model.version ) << ids[idx];
+        update++;
+      }
+      db << "COMMIT;";
+
+      total += ids.size();
+      last_id = ids.back();
+    }
+  }
+
+  RebuildRollups( db );
+  INFO( "Recalibrated {} measurements of {} devices to calibration v{}",
+        total, devices.size(), model.version );
+  return total;
+}
@@ -0,0 +1,254 @@
+#include <time.h>
+
+#include <memory>
+
+#include <event2/buffer.h>
+#include <fmt/format.h>
+
+#include "metrics.h"
+
+using namespace std;
+
+uint64_t MonotonicNanos ()
+{
+  timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return uint64_t( ts.tv_sec ) * 1000000000 + uint64_t( ts.tv_nsec );
+}
+
+size_t ThreadSlot ()
+{
+  static atomic<size_t> next_slot{ 0 };
+  thread_local size_t slot = next_slot++;
+  return slot;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Histogram
+
+Histogram::Histogram ()
+{
+  for( auto &shard : shards_ )
+  {
+    shard.store( nullptr, memory_order_relaxed );
+  }
+}
+
+Histogram::~Histogram ()
+{
+  for( auto &shard : shards_ )
+  {
+    delete shard.load();
+  }
+}
+
+size_t Histogram::Bucket( uint64_t value )
+{
+  if( value < SUB_BUCKETS )
+  {
+    return size_t( value );
+  }
+  // The power of two, then the SUB_BITS bits below the leading one
+  int msb = 63 - __builtin_clzll( value );
+  int shift = msb - SUB_BITS;
+  return size_t( shift + 1 ) * SUB_BUCKETS +
+    size_t( value >> shift ) - SUB_BUCKETS;
+}
+
+uint64_t Histogram::UpperBound( size_t bucket )
+{
+  if( bucket < SUB_BUCKETS )
+  {
+    return bucket;
+  }
+  int shift = int( bucket / SUB_BUCKETS ) - 1;
+  uint64_t lower = uint64_t( SUB_BUCKETS + bucket % SUB_BUCKETS ) << shift;
+  return lower + ( uint64_t( 1 ) << shift ) - 1;
+}
+
+Histogram::Shard* Histogram::NewShard( size_t slot )
+{
+  unique_ptr<Shard> shard( new Shard );
+  for( auto &count : shard->counts )
+  {
+    count.store( 0, memory_order_relaxed );
+  }
+  shard->count.store( 0, memory_order_relaxed );
+  shard->sum.store( 0, memory_order_relaxed );
+
+  // Threads past METRIC_SHARDS share slots, one of them installs the shard
+  Shard *expected = nullptr;
+  if( shards_[slot].compare_exchange_strong( expected, shard.get(),
+                                             memory_order_acq_rel ))
+  {
+    return shard.release();
+  }
+  return expected;
+}
+
+void Histogram::Record( uint64_t value )
+{
+  size_t slot = ThreadSlot() % METRIC_SHARDS;
+  Shard *shard = shards_[slot].load( memory_order_acquire );
+  if( !shard )
+  {
+    shard = NewShard( slot );
+  }
+  shard->counts[ Bucket( value ) ].fetch_add( 1, memory_order_relaxed );
+  shard->count.fetch_add( 1, memory_order_relaxed );
+  shard->sum.fetch_add( value, memory_order_relaxed );
+}
+
+void Histogram::Collect( Snapshot *snapshot ) const
+{
+  fill( snapshot->counts, snapshot->counts + BUCKETS, 0 );
+  snapshot->count = 0;
+  snapshot->sum = 0;
+  for( const auto &slot : shards_ )
+  {
+    const Shard *shard = slot.load( memory_order_acquire );
+    if( !shard )
+    {
+      continue;
+    }
+    for( size_t idx=0; idx < BUCKETS; ++idx )
+    {
+      snapshot->counts[idx] += shard->counts[idx].load( memory_order_relaxed );
+    }
+    snapshot->count += shard->count.load( memory_order_relaxed );
+    snapshot->sum += shard->sum.load( memory_order_relaxed );
+  }
+}
+
+uint64_t Histogram::Snapshot::Quantile( double q ) const
+{
+  // Buckets and count are read separately, so rank by the buckets' own total
+  uint64_t total = 0;
+  for( size_t idx=0; idx < BUCKETS; ++idx )
+  {
+    total += counts[idx];
+  }
+  if( total == 0 )
+  {
+    return 0;
+  }
+
+  uint64_t rank = max( uint64_t( 1 ), uint64_t( q * total + 0.5 ));
+  uint64_t seen = 0;
+  for( size_t idx=0; idx < BUCKETS; ++idx )
+  {
+    seen += counts[idx];
+    if( seen >= rank )
+    {
+      return UpperBound( idx );
+    }
+  }
+  return UpperBound( BUCKETS - 1 );
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Counter
+
+Counter::Counter ()
+{
+  for( auto &cell : cells_ )
+  {
+    cell.value.store( 0, memory_order_relaxed );
+  }
+}
+
+uint64_t Counter::Value () const
+{
+  uint64_t total = 0;
+  for( const auto &cell : cells_ )
+  {
+    total += cell.value.load( memory_order_relaxed );
+  }
+  return total;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Metrics
+
+static void RenderSummary( const char *name, const char *help,
+                           const Histogram &histogram, string *out )
+{
+  unique_ptr<Histogram::Snapshot> snapshot( new Histogram::Snapshot );
+  histogram.Collect( snapshot.get() );
+
+  *out += fmt::format( "# HELP {} {}\n# TYPE {} summary\n", name, help, name );
+  for( double q : { 0.5, 0.99, 0.999 } )
+  {
+    *out += fmt::format( "{}{{quantile=\"{}\"}} {:.9f}\n", name, q,
+                         snapshot->Quantile( q ) / 1e9 );
+  }
+  *out += fmt::format( "{}_sum {:.9f}\n{}_count {}\n", name,
+                       snapshot->sum / 1e9, name, snapshot->count );
+}
+
+static void RenderCounter( const char *name, const char *help,
+                           const Counter &counter, string *out )
+{
+  *out += fmt::format( "# HELP {} {}\n# TYPE {} counter\n{} {}\n", name, help,
+                       name, name, counter.Value() );
+}
+
+void Metrics::Render( string *out ) const
+{
+  RenderSummary( "wiight_xwii_dispatch_seconds",
+                 "Time to read one batch of board events", xwii_dispatch,
+                 out );
+  RenderSummary( "wiight_convert_seconds",
+                 "Time to calibrate one batch of samples", convert, out );
+  RenderSummary( "wiight_settle_seconds",
+                 "Time to run settle detection over one batch", settle, out );
+  RenderSummary( "wiight_sway_seconds",
+                 "Time to run sway analysis over one batch", sway, out );
+  RenderSummary( "wiight_db_commit_seconds",
+                 "Time to commit one batch of measurements", db_commit, out );
+  RenderSummary( "wiight_sample_to_client_seconds",
+                 "Time from the pipeline publishing a sample or settle event "
+                 "to it being streamed to a client", sample_to_client, out );
+  RenderSummary( "wiight_sensor_to_client_seconds",
+                 "Time from the board reading a sample or settle event to it "
+                 "being streamed to a client", sensor_to_client, out );
+  RenderSummary( "wiight_ws_send_seconds",
+                 "Time to hand one API reply to nanomsg", ws_send, out );
+  RenderSummary( "wiight_api_response_seconds",
+                 "Time from an API request arriving to its reply being sent",
+                 api_response, out );
+  RenderSummary( "wiight_http_request_seconds",
+                 "Time to handle one page or asset request", http_request,
+                 out );
+  RenderSummary( "wiight_export_batch_seconds",
+                 "Time to fetch and queue one batch of exported history",
+                 export_batch, out );
+  RenderCounter( "wiight_samples_total", "Board samples processed", samples,
+                 out );
+  RenderCounter( "wiight_stream_frames_total",
+                 "Live stream frames sent to clients", stream_frames, out );
+  RenderCounter( "wiight_db_rows_total", "Measurements committed", db_rows,
+                 out );
+  RenderCounter( "wiight_api_requests_total", "API requests received",
+                 api_requests, out );
+  RenderCounter( "wiight_http_requests_total", "Page and asset requests",
+                 http_requests, out );
+  RenderCounter( "wiight_export_rows_total", "History rows exported",
+                 export_rows, out );
+}
+
+void Metrics::MetricsCallback( evhtp_request_t *req, void *arg )
+{
+  string text;
+  static_cast<const Metrics*>( arg )->Render( &text );
+  evbuffer_add( req->buffer_out, text.data(), text.size() );
+  evhtp_headers_add_header( req->headers_out, evhtp_header_new(
+      "Content-Type", "text/plain; version=0.0.4", 0, 0 ));
+  evhtp_send_reply( req, EVHTP_RES_OK );
+}
+
+Metrics& GlobalMetrics ()
+{
+  static Metrics metrics;
+  return metrics;
+}
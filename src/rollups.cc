@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "logging.h"
+#include "rollups.h"
+
+using namespace std;
+
+const RollupTier ROLLUP_TIERS[NUM_ROLLUP_TIERS] = {
+  { "minute", "rollup_minute", 60ull * 1000000 },
+  { "hour",   "rollup_hour",   3600ull * 1000000 },
+  { "day",    "rollup_day",    86400ull * 1000000 },
+};
+
+void RollupStats::Add( double weight )
+{
+  RollupStats one;
+  one.count = 1;
+  one.min = one.max = one.mean = weight;
+  Merge( one );
+}
+
+void RollupStats::Merge( const RollupStats &other )
+{
+  if( other.count == 0 )
+  {
+    return;
+  }
+  if( count == 0 )
+  {
+    *this = other;
+    return;
+  }
+
+  uint64_t total = count + other.count;
+  double delta = other.mean - mean;
+  mean += delta * other.count / total;
+  m2 += other.m2 + delta * delta * count * other.count / total;
+  min = std::min( min, other.min );
+  max = std::max( max, other.max );
+  count = total;
+}
+
+void CreateRollupTables( sqlite::database &db )
+{
+  for( const auto &tier : ROLLUP_TIERS )
+  {
+    db << fmt::format( "CREATE TABLE IF NOT EXISTS {}( "
+      "user_id INTEGER NOT NULL,"
+      "bucket_us INTEGER NOT NULL,"
+      "count INTEGER,"
+      "min DOUBLE,"
+      "max DOUBLE,"
+      "mean DOUBLE,"
+      "m2 DOUBLE,"
+      "PRIMARY KEY( user_id, bucket_us )) WITHOUT ROWID;", tier.table );
+  }
+}
+
+RollupWriter::RollupWriter( sqlite::database &db )
+{
+  for( const auto &tier : ROLLUP_TIERS )
+  {
+    select_.push_back( db << fmt::format(
+          "SELECT count, min, max, mean, m2 FROM {} "
+          "WHERE user_id = ? AND bucket_us = ?;", tier.table ));
+    upsert_.push_back( db << fmt::format(
+          "INSERT OR REPLACE INTO {} (user_id, bucket_us, count, min, max, "
+          "mean, m2) VALUES (?, ?, ?, ?, ?, ?, ?);", tier.table ));
+    select_.back().used( true );
+    upsert_.back().used( true );
+  }
+}
+
+void RollupWriter::Add( const Measurement &measurement )
+{
+  for( size_t idx=0; idx < NUM_ROLLUP_TIERS; ++idx )
+  {
+    uint64_t bucket_us = ROLLUP_TIERS[idx].bucket_us;
+    uint64_t bucket = measurement.timestamp_us / bucket_us * bucket_us;
+    pending_[ BucketKey( idx, measurement.user_id, bucket ) ]
+      .Add( measurement.weight );
+  }
+}
+
+void RollupWriter::Write ()
+{
+  map<BucketKey, RollupStats> pending;
+  pending.swap( pending_ );
+  for( const auto &entry : pending )
+  {
+    size_t tier = get<0>( entry.first );
+    sqlite_int64 user_id = get<1>( entry.first );
+    sqlite_int64 bucket = get<2>( entry.first );
+
+    RollupStats stats;
+    select_[tier] << user_id << bucket
+      >> [&]( sqlite_int64 count, double min, double max, double mean,
+              double m2 ) {
+        stats.count = count;
+        stats.min = min;
+        stats.max = max;
+        stats.mean = mean;
+        stats.m2 = m2;
+      };
+    stats.Merge( entry.second );
+
+    upsert_[tier] << user_id << bucket << sqlite_int64( stats.count ) << stats.min
+      << stats.max << stats.mean << stats.m2;
+    upsert_[tier]++;
+  }
+}
+
+void RebuildRollups( sqlite::database &db )
+{
+  db << "BEGIN;";
+  vector<sqlite::database_binder> insert;
+  for( const auto &tier : ROLLUP_TIERS )
+  {
+    db << fmt::format( "DELETE FROM {};", tier.table );
+    insert.push_back( db << fmt::format( "INSERT INTO {} (user_id, "
+          "bucket_us, count, min, max, mean, m2) VALUES (?, ?, ?, ?, ?, ?, ?);",
+          tier.table ));
+    insert.back().used( true );
+  }
+
+  // Fold the rows through the same merge the writer uses, one open bucket
+  // per tier.  The index walks each user's rows in time order, so a bucket
+  // is complete as soon as a row falls outside it.
+  struct Bucket
+  {
+    int64_t user_id;
+    uint64_t bucket_us;
+    RollupStats stats;
+  };
+  Bucket open[NUM_ROLLUP_TIERS] = {};
+  auto close = [&]( size_t tier ) {
+    const Bucket &b = open[tier];
+    if( b.stats.count == 0 )
+    {
+      return;
+    }
+    insert[tier] << sqlite_int64( b.user_id ) << sqlite_int64( b.bucket_us )
+      << sqlite_int64( b.stats.count ) << b.stats.min << b.stats.max
+      << b.stats.mean << b.stats.m2;
+    insert[tier]++;
+  };
+
+  db << "SELECT user_id, timestamp_us, weight FROM measurements "
+    "WHERE weight IS NOT NULL ORDER BY user_id, timestamp_us;"
+    >> [&]( sqlite_int64 user_id, sqlite_int64 timestamp_us, double weight ) {
+      for( size_t tier=0; tier < NUM_ROLLUP_TIERS; ++tier )
+      {
+        uint64_t width = ROLLUP_TIERS[tier].bucket_us;
+        uint64_t bucket = uint64_t( timestamp_us ) / width * width;
+        Bucket &b = open[tier];
+        if( b.stats.count == 0 || b.user_id != user_id ||
+            b.bucket_us != bucket )
+        {
+          close( tier );
+          b = Bucket{ user_id, bucket, RollupStats() };
+        }
+        b.stats.Add( weight );
+      }
+    };
+  for( size_t tier=0; tier < NUM_ROLLUP_TIERS; ++tier )
+  {
+    close( tier );
+  }
+  db << "COMMIT;";
+}
+
+string QueryHistory( sqlite::database &db, int64_t user_id,
+                     uint64_t start_us, uint64_t end_us, size_t max_points,
+                     vector<HistoryPoint> *out )
+{
+  out->clear();
+  if( end_us <= start_us )
+  {
+    throw invalid_argument( "history needs end_us after start_us" );
+  }
+  max_points = max<size_t>( max_points, 1 );
+  // Rounded up, so max_points points of this width cover the span
+  uint64_t resolution_us = ( end_us - start_us + max_points - 1 ) / max_points;
+
+  // Rows go straight out for raw spans, into buckets for the tiers
+  vector<HistoryPoint> buckets;
+  vector<HistoryPoint> *rows = out;
+  auto add_point = [&]( sqlite_int64 timestamp, sqlite_int64 count,
+                        double min, double max, double mean, double m2 ) {
+    HistoryPoint point;
+    point.timestamp_us = timestamp;
+    point.stats.count = count;
+    point.stats.min = min;
+    point.stats.max = max;
+    point.stats.mean = mean;
+    point.stats.m2 = m2;
+    rows->push_back( point );
+  };
+
+  if( resolution_us < ROLLUP_TIERS[0].bucket_us )
+  {
+    // Finer than a minute: the measurements themselves, if there are no more
+    // of them than points asked for.  Reading one past is enough to tell.
+    db << "SELECT timestamp_us, 1, weight, weight, weight, 0 FROM measurements "
+      "WHERE user_id = ? AND timestamp_us >= ? AND timestamp_us < ? "
+      "ORDER BY timestamp_us LIMIT ?;"
+      << sqlite_int64( user_id ) << sqlite_int64( start_us )
+      << sqlite_int64( end_us ) << sqlite_int64( max_points + 1 )
+      >> add_point;
+    if( out->size() <= max_points )
+    {
+      return "raw";
+    }
+    out->clear();
+  }
+
+  // The finest tier whose buckets are at least a point wide.  Past the
+  // coarsest tier its buckets are merged into points of a whole number of
+  // them.
+  const RollupTier *chosen = &ROLLUP_TIERS[NUM_ROLLUP_TIERS - 1];
+  for( const auto &tier : ROLLUP_TIERS )
+  {
+    if( tier.bucket_us >= resolution_us )
+    {
+      chosen = &tier;
+      break;
+    }
+  }
+  uint64_t bucket_us = chosen->bucket_us;
+  uint64_t width = ( resolution_us + bucket_us - 1 ) / bucket_us * bucket_us;
+  uint64_t first = start_us / bucket_us * bucket_us;
+
+  rows = &buckets;
+  db << fmt::format( "SELECT bucket_us, count, min, max, mean, m2 FROM {} "
+                     "WHERE user_id = ? AND bucket_us >= ? AND bucket_us < ? "
+                     "ORDER BY bucket_us;", chosen->table )
+    << sqlite_int64( user_id ) << sqlite_int64( first )
+    << sqlite_int64( end_us )
+    >> add_point;
+  for( const auto &bucket : buckets )
+  {
+    uint64_t timestamp = first +
+      ( bucket.timestamp_us - first ) / width * width;
+    if( out->empty() || out->back().timestamp_us != timestamp )
+    {
+      out->push_back( { timestamp, RollupStats() } );
+    }
+    out->back().stats.Merge( bucket.stats );
+  }
+  return chosen->name;
+}
@@ -0,0 +1,305 @@
+#include <cmath>
+
+#include "logging.h"
+#include "metrics.h"
+#include "sample_pipeline.h"
+
+using namespace std;
+
+static constexpr size_t BATCH = 256;
+
+// How often sources without a descriptor, and the ring behind a reader
+// thread, are checked.  Well under the board's 10 ms sample period.
+static const timeval POLL_INTERVAL = { 0, 2000 };
+
+// Samples under this share of the settled weight are someone stepping off or
+// shifting onto one foot, not sway, and are left out of the analysis.
+static constexpr double SWAY_MIN_LOAD = 0.8;
+
+// Builds the stored record for a settled weighing from the raw samples the
+// detector's window covered.
+static Measurement MakeMeasurement( uint32_t device, const SettleEvent &event,
+                                    const vector<RawSample> &window,
+                                    const CalibrationModel &model )
+{
+  double sums[4] = { 0, 0, 0, 0 };
+  for( const auto &sample : window )
+  {
+    for( int i=0; i < 4; ++i )
+    {
+      sums[i] += sample.corners[i];
+    }
+  }
+
+  RawSample mean{ event.timestamp_us, { 0, 0, 0, 0 } };
+  for( int i=0; i < 4; ++i )
+  {
+    mean.corners[i] = int32_t( lround( sums[i] / window.size() ));
+  }
+
+  RawBatch raw;
+  raw.Append( mean );
+  ConvertedBatch converted;
+  ConvertBatch( raw, model, &converted );
+
+  Measurement m;
+  m.timestamp_us = event.timestamp_us;
+  m.device = device;
+  m.user_id = 0;
+  m.weight = event.weight;
+  m.stddev = event.stddev;
+  m.confidence = event.confidence;
+  m.cop_x = converted.cop_x[0];
+  m.cop_y = converted.cop_y[0];
+  copy_n( mean.corners, 4, m.corners );
+  m.calibration = model.version;
+  return m;
+}
+
+SamplePipeline::SamplePipeline( uint32_t device, const Calibrator &calibrator,
+                                MeasurementStore &store,
+                                SampleRing<RawSample> &ring,
+                                EventHandler on_event )
+  : device_{ device }, calibrator_( calibrator ), store_( store ), ring_( ring ),
+    cursor_{ ring.NewReader() }, on_event_( move( on_event )),
+    reader_{ nullptr }, event_{ nullptr }, sway_weight_{ 0 },
+    sway_user_{ 0 }, recent_( SettleConfig().window ), recent_next_{ 0 },
+    samples_( BATCH ), processed_{ 0 }, dropped_{ 0 }, last_us_{ 0 },
+    period_us_{ 0 }, finished_{ false }
+{
+  raw_.Reserve( BATCH );
+}
+
+SamplePipeline::~SamplePipeline ()
+{
+  if( event_ )
+  {
+    event_free( event_ );
+  }
+  if( cursor_.Overruns() )
+  {
+    WARN( "Device {} lost {} samples to ring overruns", device_,
+          cursor_.Overruns() );
+  }
+}
+
+void SamplePipeline::ReadOnLoop( event_base *base,
+                                 unique_ptr<SensorSource> source )
+{
+  if( event_ )
+  {
+    event_free( event_ );
+  }
+  // A new connection starts a new weighing, and its first sample isn't a gap
+  detector_ = SettleDetector();
+  if( sway_.Active() )
+  {
+    // Like the weighing, a session cut short by a disconnect is dropped
+    SwaySession cut_short;
+    sway_.End( last_us_, &cut_short );
+  }
+  last_us_ = 0;
+  finished_ = false;
+
+  period_us_ = source->PeriodMicros();
+  source_ = move( source );
+  int fd = source_->Fd();
+  if( fd >= 0 )
+  {
+    event_ = event_new( base, fd, EV_READ | EV_PERSIST, ReadableCallback,
+                        this );
+    event_add( event_, nullptr );
+  }
+  else
+  {
+    event_ = event_new( base, -1, EV_PERSIST, PollCallback, this );
+    event_add( event_, &POLL_INTERVAL );
+  }
+}
+
+void SamplePipeline::ConsumeOnLoop( event_base *base,
+                                    const SensorReader &reader )
+{
+  reader_ = &reader;
+  period_us_ = reader.PeriodMicros();
+  event_ = event_new( base, -1, EV_PERSIST, PollCallback, this );
+  event_add( event_, &POLL_INTERVAL );
+}
+
+bool SamplePipeline::ReadSource ()
+{
+  int count = source_->Read( samples_.data(), int( samples_.size() ));
+  if( count < 0 )
+  {
+    return false;
+  }
+  for( int idx=0; idx < count; ++idx )
+  {
+    ring_.Push( samples_[idx] );
+  }
+  return true;
+}
+
+void SamplePipeline::Process ()
+{
+  Metrics &metrics = GlobalMetrics();
+  size_t count;
+  while( (count = cursor_.Read( samples_.data(), samples_.size() )) > 0 )
+  {
+    // One calibration snapshot per batch, a new version applies to the next
+    auto model = calibrator_.Current();
+    raw_.Clear();
+    raw_.Append( samples_.data(), count );
+    {
+      ScopedTimer timer( metrics.convert );
+      ConvertBatch( raw_, *model, &converted_ );
+    }
+    if( on_batch_ )
+    {
+      on_batch_( raw_, converted_ );
+    }
+
+    batch_events_.clear();
+    {
+      ScopedTimer timer( metrics.settle );
+      SettleEvent event;
+      for( size_t idx=0; idx < count; ++idx )
+      {
+        CountGap( raw_.timestamp_us[idx] );
+        recent_[ recent_next_ ] = samples_[idx];
+        recent_next_ = ( recent_next_ + 1 ) % recent_.size();
+
+        if( detector_.Add( raw_.timestamp_us[idx], converted_.weight[idx],
+                           &event ))
+        {
+          int64_t user_id = 0;
+          if( event.type == SettleEvent::SETTLED )
+          {
+            Measurement m = MakeMeasurement( device_, event, recent_,
+                                             *model );
+            if( identify_ )
+            {
+              m.user_id = identify_( event.timestamp_us, event.weight );
+            }
+            user_id = m.user_id;
+            store_.Enqueue( m );
+          }
+          on_event_( event );
+          batch_events_.push_back( BatchEvent{ idx, event, user_id } );
+        }
+      }
+    }
+
+    // Sway over the same samples, starting and ending sessions at the
+    // samples whose events did, under its own timer
+    {
+      ScopedTimer timer( metrics.sway );
+      auto next_event = batch_events_.begin();
+      bool swayed = false;
+      for( size_t idx=0; idx < count; ++idx )
+      {
+        if( next_event != batch_events_.end() && next_event->idx == idx )
+        {
+          TrackSway( next_event->event, next_event->user_id );
+          ++next_event;
+        }
+        if( sway_.Active() &&
+            converted_.weight[idx] >= SWAY_MIN_LOAD * sway_weight_ )
+        {
+          sway_.Add( raw_.timestamp_us[idx], converted_.cop_x[idx],
+                     converted_.cop_y[idx] );
+          swayed = true;
+        }
+      }
+      if( swayed && on_sway_ )
+      {
+        SwayMetrics sway;
+        sway_.Window( &sway );
+        on_sway_( sway );
+      }
+    }
+    processed_ += count;
+    metrics.samples.Add( count );
+  }
+}
+
+void SamplePipeline::TrackSway( const SettleEvent &event, int64_t user_id )
+{
+  if( event.type == SettleEvent::SETTLED )
+  {
+    sway_.Begin( event.timestamp_us, event.weight );
+    sway_weight_ = event.weight;
+    sway_user_ = user_id;
+  }
+  else if( event.type == SettleEvent::STEP_OFF && sway_.Active() )
+  {
+    SwaySession session;
+    sway_.End( event.timestamp_us, &session );
+    session.device = device_;
+    session.user_id = sway_user_;
+    if( on_session_ )
+    {
+      on_session_( session );
+    }
+  }
+}
+
+// A gap of more than twice the source's period lost reports.
+void SamplePipeline::CountGap( uint64_t timestamp_us )
+{
+  if( last_us_ != 0 && timestamp_us > last_us_ + 2 * period_us_ )
+  {
+    dropped_ += ( timestamp_us - last_us_ ) / period_us_ - 1;
+  }
+  last_us_ = timestamp_us;
+}
+
+void SamplePipeline::Finish ()
+{
+  INFO( "Sensor source of device {} is exhausted after {} samples", device_,
+        processed_ );
+  event_free( event_ );
+  event_ = nullptr;
+  source_.reset();
+  finished_ = true;
+  if( on_finish_ )
+  {
+    on_finish_();
+  }
+}
+
+void SamplePipeline::ReadableCallback( evutil_socket_t fd, short what,
+                                       void *arg )
+{
+  (void) fd;
+  (void) what;
+  auto pipeline = static_cast<SamplePipeline*>( arg );
+  bool more = pipeline->ReadSource();
+  pipeline->Process();
+  if( !more )
+  {
+    pipeline->Finish();
+  }
+}
+
+void SamplePipeline::PollCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  auto pipeline = static_cast<SamplePipeline*>( arg );
+  bool more;
+  if( pipeline->source_ )
+  {
+    more = pipeline->ReadSource();
+  }
+  else
+  {
+    // Checked before draining so nothing pushed last is left behind
+    more = !pipeline->reader_->Finished();
+  }
+  pipeline->Process();
+  if( !more )
+  {
+    pipeline->Finish();
+  }
+}
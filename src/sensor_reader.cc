@@ -0,0 +1,74 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+
+#include "logging.h"
+#include "sensor_reader.h"
+
+using namespace std;
+
+SensorReader::SensorReader( unique_ptr<SensorSource> source,
+                            SampleRing<RawSample> &ring )
+  : source_{ move( source ) }, ring_( ring ), should_stop_{ false },
+    finished_{ false }, samples_read_{ 0 }
+{
+}
+
+SensorReader::~SensorReader ()
+{
+  Stop();
+}
+
+void SensorReader::Start( int cpu )
+{
+  thread_ = thread( &SensorReader::Run, this );
+
+  if( cpu >= 0 )
+  {
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    CPU_SET( cpu, &cpus );
+    int ret = pthread_setaffinity_np( thread_.native_handle(),
+                                      sizeof( cpus ), &cpus );
+    if( ret != 0 )
+    {
+      WARN( "Cannot pin sensor reader to cpu {}: {}", cpu, strerror( ret ));
+    }
+    else
+    {
+      INFO( "Sensor reader pinned to cpu {}", cpu );
+    }
+  }
+}
+
+void SensorReader::Stop ()
+{
+  should_stop_ = true;
+  if( thread_.joinable() )
+  {
+    thread_.join();
+  }
+}
+
+void SensorReader::Run ()
+{
+  RawSample samples[64];
+  while( !should_stop_ )
+  {
+    // Bounded wait so Stop() is noticed even when the board is idle
+    source_->Wait( 100 );
+    int count = source_->Read( samples, 64 );
+    if( count < 0 )
+    {
+      break;
+    }
+
+    for( int idx=0; idx < count; ++idx )
+    {
+      ring_.Push( samples[idx] );
+    }
+    samples_read_.fetch_add( count, memory_order_relaxed );
+  }
+  finished_ = true;
+}
@@ -0,0 +1,390 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#include <xwiimote.h>
+
+#include "calibration.h"
+#include "logging.h"
+#include "metrics.h"
+#include "sensor_source.h"
+
+using namespace std;
+
+static constexpr char LOG_MAGIC[8] = { 'W', 'I', 'I', 'G', 'H', 'T', 'L', 'G' };
+static constexpr uint32_t LOG_VERSION = 1;
+
+// The board reports at 100 Hz
+static constexpr uint64_t BOARD_PERIOD_US = 10000;
+
+uint64_t MonotonicMicros ()
+{
+  timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return uint64_t( ts.tv_sec ) * 1000000 + uint64_t( ts.tv_nsec ) / 1000;
+}
+
+uint64_t WallMicros ()
+{
+  timespec ts;
+  clock_gettime( CLOCK_REALTIME, &ts );
+  return uint64_t( ts.tv_sec ) * 1000000 + uint64_t( ts.tv_nsec ) / 1000;
+}
+
+uint64_t SensorSource::PeriodMicros () const
+{
+  return BOARD_PERIOD_US;
+}
+
+void SensorSource::Wait( int timeout_ms )
+{
+  struct pollfd fds[1];
+  memset( fds, 0, sizeof( fds ));
+  fds[0].fd = Fd();
+  fds[0].events = POLLIN;
+
+  int ret = poll( fds, 1, timeout_ms );
+  if( ret < 0 && errno != EINTR )
+  {
+    ERROR( "Cannot poll fds: {}", -errno );
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// XwiiSource
+
+XwiiSource::XwiiSource( ::xwii_iface *iface ) : iface_{ iface }
+{
+  int ret = ::xwii_iface_watch( iface_, true );
+  if( ret )
+  {
+    ERROR( "Cannot initialize hotplug watch descriptor" );
+  }
+}
+
+XwiiSource::~XwiiSource ()
+{
+  ::xwii_iface_unref( iface_ );
+}
+
+int XwiiSource::Fd () const
+{
+  return ::xwii_iface_get_fd( iface_ );
+}
+
+int XwiiSource::Read( RawSample *out, int max )
+{
+  ScopedTimer timer( GlobalMetrics().xwii_dispatch );
+  ::xwii_event event;
+  int count = 0;
+  while( count < max )
+  {
+    int ret = ::xwii_iface_dispatch( iface_, &event, sizeof( event ));
+    if( ret == -EAGAIN )
+    {
+      break;
+    }
+    else if( ret )
+    {
+      ERROR( "Read failed with err: {}", ret );
+      return count > 0 ? count : -1;
+    }
+
+    if( event.type == XWII_EVENT_GONE )
+    {
+      WARN( "Balance board is gone" );
+      return count > 0 ? count : -1;
+    }
+    else if( event.type == XWII_EVENT_BALANCE_BOARD )
+    {
+      RawSample &sample = out[count++];
+      sample.timestamp_us =
+        uint64_t( event.time.tv_sec ) * 1000000 + event.time.tv_usec;
+      for( int i=0; i < 4; ++i )
+      {
+        sample.corners[i] = event.v.abs[i].x;
+      }
+    }
+  }
+  return count;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// RecordingSource
+
+RecordingSource::RecordingSource( unique_ptr<SensorSource> inner,
+                                  const string &path )
+  : inner_{ move( inner ) }, log_{ nullptr }
+{
+  log_ = fopen( path.c_str(), "ab" );
+  if( !log_ )
+  {
+    FATAL( "Cannot open sample log '{}': {}", path, strerror( errno ));
+  }
+
+  // A fresh file gets a header, an existing one is appended to.
+  if( ftell( log_ ) == 0 )
+  {
+    SampleLogHeader header;
+    memset( &header, 0, sizeof( header ));
+    memcpy( header.magic, LOG_MAGIC, sizeof( header.magic ));
+    header.version = LOG_VERSION;
+    header.record_size = sizeof( RawSample );
+    header.start_us = WallMicros();
+    fwrite( &header, sizeof( header ), 1, log_ );
+  }
+  INFO( "Recording samples to '{}'", path );
+}
+
+RecordingSource::~RecordingSource ()
+{
+  fclose( log_ );
+}
+
+int RecordingSource::Fd () const
+{
+  return inner_->Fd();
+}
+
+uint64_t RecordingSource::PeriodMicros () const
+{
+  return inner_->PeriodMicros();
+}
+
+int RecordingSource::Read( RawSample *out, int max )
+{
+  int count = inner_->Read( out, max );
+  if( count > 0 &&
+      fwrite( out, sizeof( RawSample ), count, log_ ) != size_t( count ))
+  {
+    ERROR( "Short write to sample log: {}", strerror( errno ));
+  }
+  return count;
+}
+
+void RecordingSource::Wait( int timeout_ms )
+{
+  inner_->Wait( timeout_ms );
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// ReplaySource
+
+ReplaySource::ReplaySource( const string &path, double speed )
+  : map_{ nullptr }, map_size_{ 0 }, records_{ nullptr }, num_records_{ 0 },
+    next_{ 0 }, speed_{ speed }, wall_start_us_{ MonotonicMicros() }
+{
+  int fd = open( path.c_str(), O_RDONLY );
+  if( fd < 0 )
+  {
+    FATAL( "Cannot open sample log '{}': {}", path, strerror( errno ));
+  }
+
+  struct stat st;
+  fstat( fd, &st );
+  map_size_ = st.st_size;
+  if( map_size_ < sizeof( SampleLogHeader ))
+  {
+    close( fd );
+    FATAL( "Sample log '{}' is truncated", path );
+  }
+
+  map_ = mmap( nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( map_ == MAP_FAILED )
+  {
+    FATAL( "Cannot map sample log '{}': {}", path, strerror( errno ));
+  }
+  madvise( map_, map_size_, MADV_SEQUENTIAL );
+
+  auto header = reinterpret_cast<const SampleLogHeader*>( map_ );
+  if( memcmp( header->magic, LOG_MAGIC, sizeof( LOG_MAGIC )) != 0 ||
+      header->version != LOG_VERSION ||
+      header->record_size != sizeof( RawSample ))
+  {
+    munmap( map_, map_size_ );
+    FATAL( "'{}' is not a version {} sample log", path, LOG_VERSION );
+  }
+
+  records_ = reinterpret_cast<const RawSample*>( header + 1 );
+  num_records_ = ( map_size_ - sizeof( SampleLogHeader )) / sizeof( RawSample );
+  INFO( "Replaying {} samples from '{}' at speed {}", num_records_, path,
+        speed_ );
+}
+
+ReplaySource::~ReplaySource ()
+{
+  munmap( map_, map_size_ );
+}
+
+int ReplaySource::Fd () const
+{
+  return -1;
+}
+
+uint64_t ReplaySource::DueAt( size_t idx ) const
+{
+  // Appended logs may step backwards in time, treat those records as due now.
+  uint64_t first = records_[0].timestamp_us;
+  uint64_t offset = records_[idx].timestamp_us > first ?
+    records_[idx].timestamp_us - first : 0;
+  return wall_start_us_ + uint64_t( offset / speed_ );
+}
+
+int ReplaySource::Read( RawSample *out, int max )
+{
+  if( next_ >= num_records_ )
+  {
+    return -1;
+  }
+
+  size_t end = min( num_records_, next_ + size_t( max ));
+  if( speed_ > 0 )
+  {
+    uint64_t now = MonotonicMicros();
+    size_t due = next_;
+    while( due < end && DueAt( due ) <= now )
+    {
+      ++due;
+    }
+    end = due;
+  }
+
+  size_t count = end - next_;
+  memcpy( out, records_ + next_, count * sizeof( RawSample ));
+  next_ = end;
+  return int( count );
+}
+
+void ReplaySource::Wait( int timeout_ms )
+{
+  if( speed_ <= 0 || next_ >= num_records_ )
+  {
+    return;
+  }
+
+  uint64_t now = MonotonicMicros();
+  uint64_t due = DueAt( next_ );
+  if( due <= now )
+  {
+    return;
+  }
+
+  uint64_t sleep_us = due - now;
+  if( timeout_ms >= 0 )
+  {
+    sleep_us = min( sleep_us, uint64_t( timeout_ms ) * 1000 );
+  }
+  this_thread::sleep_for( chrono::microseconds( sleep_us ));
+}
+
+SimulatedSource::SimulatedSource( uint32_t board, double rate_hz,
+                                  uint64_t count )
+  : weight_{ 110.0 + 17.0 * ( board % 7 ) }, phase_{ board * 397ULL },
+    rate_hz_{ rate_hz }, count_{ count },
+    // Past 1 MHz the microsecond clock can't tell samples apart anyway
+    period_us_{ rate_hz > 0 ? max<uint64_t>( uint64_t( 1e6 / rate_hz ), 1 ) :
+                BOARD_PERIOD_US },
+    start_us_{ MonotonicMicros() }, epoch_us_{ WallMicros() }, next_{ 0 },
+    noise_{ 0x9E3779B97F4A7C15ULL * ( board + 1 ) }
+{
+}
+
+int SimulatedSource::Fd () const
+{
+  return -1;
+}
+
+void SimulatedSource::Generate( uint64_t idx, RawSample *out )
+{
+  // 3 s empty, then 20 s on the board at the nominal 100 Hz
+  static constexpr uint64_t CYCLE = 2300;
+  static constexpr uint64_t EMPTY = 300;
+  uint64_t at = ( idx + phase_ ) % CYCLE;
+  double t = at / 100.0;
+
+  double pounds = 0;
+  double sway_x = 0;
+  double sway_y = 0;
+  if( at >= EMPTY )
+  {
+    // Settling from a wobble to quiet standing, with a slow postural sway
+    double wobble = exp( -double( at - EMPTY ) / 150.0 );
+    pounds = weight_ * ( 1 + 0.05 * wobble * sin( 2 * M_PI * 1.5 * t ));
+    sway_x = 0.04 * sin( 2 * M_PI * 0.3 * t ) + 0.1 * wobble;
+    sway_y = 0.03 * sin( 2 * M_PI * 0.17 * t + 1 );
+  }
+
+  out->timestamp_us = epoch_us_ + idx * period_us_;
+  double corner_raw = pounds / RAW_TO_POUNDS / 4;
+  const double share[4] = {
+    1 + sway_x + sway_y,   // TOP_RIGHT
+    1 - sway_x - sway_y,   // BOTTOM_LEFT
+    1 - sway_x + sway_y,   // TOP_LEFT
+    1 + sway_x - sway_y,   // BOTTOM_RIGHT
+  };
+  for( int corner=0; corner < 4; ++corner )
+  {
+    noise_ ^= noise_ << 13;
+    noise_ ^= noise_ >> 7;
+    noise_ ^= noise_ << 17;
+    out->corners[corner] = int32_t( corner_raw * share[corner] ) +
+      int32_t( noise_ % 5 ) - 2;
+  }
+}
+
+int SimulatedSource::Read( RawSample *out, int max )
+{
+  uint64_t end = next_ + uint64_t( max );
+  if( count_ > 0 )
+  {
+    if( next_ >= count_ )
+    {
+      return -1;
+    }
+    end = min( end, count_ );
+  }
+  if( rate_hz_ > 0 )
+  {
+    uint64_t due = ( MonotonicMicros() - start_us_ ) / period_us_ + 1;
+    end = min( end, due );
+  }
+
+  int n = 0;
+  for( ; next_ < end; ++next_ )
+  {
+    Generate( next_, &out[n++] );
+  }
+  return n;
+}
+
+void SimulatedSource::Wait( int timeout_ms )
+{
+  if( rate_hz_ <= 0 )
+  {
+    return;
+  }
+
+  uint64_t due = start_us_ + next_ * period_us_;
+  uint64_t now = MonotonicMicros();
+  if( due <= now )
+  {
+    return;
+  }
+
+  uint64_t sleep_us = due - now;
+  if( timeout_ms >= 0 )
+  {
+    sleep_us = min( sleep_us, uint64_t( timeout_ms ) * 1000 );
+  }
+  this_thread::sleep_for( chrono::microseconds( sleep_us ));
+}
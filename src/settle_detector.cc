@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cmath>
+
+#include "settle_detector.h"
+
+using namespace std;
+
+const char* SettleEventName( SettleEvent::Type type )
+{
+  switch( type )
+  {
+    case SettleEvent::STEP_ON:  return "step_on";
+    case SettleEvent::SETTLED:  return "settled";
+    case SettleEvent::STEP_OFF: return "step_off";
+  }
+  return "unknown";
+}
+
+SettleDetector::SettleDetector( const SettleConfig &config )
+  : config_( config ), state_{ State::EMPTY },
+    median_buf_( min<size_t>( max<size_t>( config.median, 1 ), 15 ), 0.0 ),
+    median_next_{ 0 }, median_count_{ 0 },
+    window_( max<size_t>( config.window, 2 ), 0.0 ),
+    window_next_{ 0 }, count_{ 0 }, mean_{ 0 }, m2_{ 0 }, settled_()
+{
+}
+
+double SettleDetector::StdDev () const
+{
+  return count_ > 1 ? sqrt( max( m2_, 0.0 ) / ( count_ - 1 )) : 0.0;
+}
+
+double SettleDetector::MedianFilter( double weight )
+{
+  median_buf_[ median_next_ ] = weight;
+  median_next_ = ( median_next_ + 1 ) % median_buf_.size();
+  median_count_ = min( median_count_ + 1, median_buf_.size() );
+
+  // The filter is a handful of samples long, so a copy and nth_element is
+  // cheaper than maintaining an order statistic structure.
+  double sorted[15];
+  size_t n = median_count_;
+  copy_n( median_buf_.begin(), n, sorted );
+  nth_element( sorted, sorted + n/2, sorted + n );
+  return sorted[ n/2 ];
+}
+
+void SettleDetector::Push( double weight )
+{
+  if( count_ == window_.size() )
+  {
+    // Remove the oldest sample from the running stats
+    double old = window_[ window_next_ ];
+    double delta = old - mean_;
+    --count_;
+    mean_ -= delta / count_;
+    m2_ -= delta * ( old - mean_ );
+  }
+
+  window_[ window_next_ ] = weight;
+  window_next_ = ( window_next_ + 1 ) % window_.size();
+
+  ++count_;
+  double delta = weight - mean_;
+  mean_ += delta / count_;
+  m2_ += delta * ( weight - mean_ );
+}
+
+void SettleDetector::ResetWindow ()
+{
+  window_next_ = 0;
+  count_ = 0;
+  mean_ = 0;
+  m2_ = 0;
+}
+
+bool SettleDetector::Add( uint64_t timestamp_us, double weight,
+                          SettleEvent *event )
+{
+  double filtered = MedianFilter( weight );
+
+  switch( state_ )
+  {
+    case State::EMPTY:
+      if( filtered < config_.step_on_weight )
+      {
+        return false;
+      }
+      state_ = State::LOADING;
+      ResetWindow();
+      Push( filtered );
+      *event = { SettleEvent::STEP_ON, timestamp_us, filtered, 0, 0 };
+      return true;
+
+    case State::LOADING:
+    case State::SETTLED:
+      if( filtered < config_.step_off_weight )
+      {
+        if( state_ == State::SETTLED )
+        {
+          *event = settled_;
+        }
+        else
+        {
+          *event = { SettleEvent::STEP_OFF, 0, filtered, 0, 0 };
+        }
+        event->type = SettleEvent::STEP_OFF;
+        event->timestamp_us = timestamp_us;
+        state_ = State::EMPTY;
+        return true;
+      }
+
+      Push( filtered );
+      if( state_ == State::LOADING && count_ == window_.size() )
+      {
+        double stddev = StdDev();
+        if( stddev < config_.settle_stddev )
+        {
+          state_ = State::SETTLED;
+          double confidence = 1.0 - stddev / config_.settle_stddev;
+          settled_ = { SettleEvent::SETTLED, timestamp_us, mean_, stddev,
+                       confidence };
+          *event = settled_;
+          return true;
+        }
+      }
+      return false;
+  }
+  return false;
+}
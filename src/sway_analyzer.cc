@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <cmath>
+
+#include "sway_analyzer.h"
+
+using namespace std;
+
+// Chi-squared with two degrees of freedom at 95%, scaling the covariance
+// ellipse to one holding 95% of the positions.
+static constexpr double CHI2_95 = 5.991;
+
+// The window must hold every bin below the Nyquist frequency, and the
+// twiddles are indexed by bin.
+static SwayConfig Checked( SwayConfig config )
+{
+  config.window = max<size_t>( config.window, 2 * SWAY_BINS + 1 );
+  return config;
+}
+
+SwayAnalyzer::SwayAnalyzer( const SwayConfig &config )
+  : config_( Checked( config )), active_{ false }, xs_( config_.window ),
+    ys_( config_.window ), steps_( config_.window ),
+    twiddles_( config_.window )
+{
+  for( size_t idx=0; idx < config_.window; ++idx )
+  {
+    twiddles_[idx] = polar( 1.0, -2 * M_PI * idx / config_.window );
+  }
+  Begin( 0, 0 );
+  active_ = false;
+}
+
+void SwayAnalyzer::Begin( uint64_t timestamp_us, double weight )
+{
+  fill( xs_.begin(), xs_.end(), 0.0 );
+  fill( ys_.begin(), ys_.end(), 0.0 );
+  fill( steps_.begin(), steps_.end(), 0.0 );
+  next_ = 0;
+  count_ = 0;
+  since_resync_ = 0;
+  origin_x_ = 0;
+  origin_y_ = 0;
+  last_us_ = timestamp_us;
+  sum_x_ = sum_y_ = sum_xx_ = sum_yy_ = sum_xy_ = sum_steps_ = 0;
+  fill( dft_x_, dft_x_ + SWAY_BINS, 0.0 );
+  fill( dft_y_, dft_y_ + SWAY_BINS, 0.0 );
+
+  session_ = SwaySession();
+  session_.start_us = timestamp_us;
+  session_.weight = weight;
+  total_x_ = total_y_ = total_xx_ = total_yy_ = total_xy_ = 0;
+  frequency_sum_ = 0;
+  frequency_windows_ = 0;
+  active_ = true;
+}
+
+void SwayAnalyzer::Add( uint64_t timestamp_us, double cop_x, double cop_y )
+{
+  if( !active_ )
+  {
+    return;
+  }
+  const size_t n = config_.window;
+  if( session_.samples == 0 )
+  {
+    origin_x_ = cop_x;
+    origin_y_ = cop_y;
+  }
+  double x = cop_x - origin_x_;
+  double y = cop_y - origin_y_;
+  double step = 0;
+  if( count_ > 0 )
+  {
+    size_t prev = ( next_ + n - 1 ) % n;
+    step = hypot( x - xs_[prev], y - ys_[prev] );
+  }
+
+  // The slot about to be overwritten holds the oldest sample, or zeros
+  double old_x = xs_[next_];
+  double old_y = ys_[next_];
+  if( count_ == n )
+  {
+    sum_x_ -= old_x;
+    sum_y_ -= old_y;
+    sum_xx_ -= old_x * old_x;
+    sum_yy_ -= old_y * old_y;
+    sum_xy_ -= old_x * old_y;
+    sum_steps_ -= steps_[next_];
+  }
+  else
+  {
+    ++count_;
+  }
+  sum_x_ += x;
+  sum_y_ += y;
+  sum_xx_ += x * x;
+  sum_yy_ += y * y;
+  sum_xy_ += x * y;
+  sum_steps_ += step;
+
+  // X_k(n) = ( X_k(n-1) - x(n-N) + x(n) ) * exp( 2 pi j k / N )
+  for( size_t bin=1; bin <= SWAY_BINS; ++bin )
+  {
+    complex<double> rotate = conj( twiddles_[bin] );
+    dft_x_[bin-1] = ( dft_x_[bin-1] - old_x + x ) * rotate;
+    dft_y_[bin-1] = ( dft_y_[bin-1] - old_y + y ) * rotate;
+  }
+
+  xs_[next_] = x;
+  ys_[next_] = y;
+  steps_[next_] = step;
+  next_ = ( next_ + 1 ) % n;
+  last_us_ = timestamp_us;
+
+  ++session_.samples;
+  session_.path_length += step;
+  total_x_ += x;
+  total_y_ += y;
+  total_xx_ += x * x;
+  total_yy_ += y * y;
+  total_xy_ += x * y;
+
+  if( ++since_resync_ >= n )
+  {
+    Resync();
+    if( count_ == n )
+    {
+      frequency_sum_ += MeanFrequency();
+      ++frequency_windows_;
+    }
+  }
+}
+
+void SwayAnalyzer::Resync ()
+{
+  const size_t n = config_.window;
+  sum_x_ = sum_y_ = sum_xx_ = sum_yy_ = sum_xy_ = sum_steps_ = 0;
+  for( size_t idx=0; idx < n; ++idx )
+  {
+    sum_x_ += xs_[idx];
+    sum_y_ += ys_[idx];
+    sum_xx_ += xs_[idx] * xs_[idx];
+    sum_yy_ += ys_[idx] * ys_[idx];
+    sum_xy_ += xs_[idx] * ys_[idx];
+    sum_steps_ += steps_[idx];
+  }
+
+  // X_k = sum over the window, oldest first, of x(m) exp( -2 pi j k m / N )
+  for( size_t bin=1; bin <= SWAY_BINS; ++bin )
+  {
+    complex<double> x = 0;
+    complex<double> y = 0;
+    for( size_t m=0; m < n; ++m )
+    {
+      size_t slot = ( next_ + m ) % n;
+      const complex<double> &w = twiddles_[ ( bin * m ) % n ];
+      x += xs_[slot] * w;
+      y += ys_[slot] * w;
+    }
+    dft_x_[bin-1] = x;
+    dft_y_[bin-1] = y;
+  }
+  since_resync_ = 0;
+}
+
+double SwayAnalyzer::MeanFrequency () const
+{
+  double bin_hz = config_.sample_rate / config_.window;
+  double power = 0;
+  double weighted = 0;
+  for( size_t bin=1; bin <= SWAY_BINS; ++bin )
+  {
+    double p = norm( dft_x_[bin-1] ) + norm( dft_y_[bin-1] );
+    power += p;
+    weighted += p * bin * bin_hz;
+  }
+  return power > 0 ? weighted / power : 0;
+}
+
+// RMS distances and 95% ellipse area from sums over n positions.
+static void Spread( double n, double sx, double sy, double sxx, double syy,
+                    double sxy, double *rms_x, double *rms_y,
+                    double *ellipse_area )
+{
+  double mx = sx / n;
+  double my = sy / n;
+  double var_x = max( 0.0, sxx / n - mx * mx );
+  double var_y = max( 0.0, syy / n - my * my );
+  double cov = sxy / n - mx * my;
+  *rms_x = sqrt( var_x );
+  *rms_y = sqrt( var_y );
+  *ellipse_area = M_PI * CHI2_95 * sqrt( max( 0.0, var_x * var_y - cov * cov ));
+}
+
+void SwayAnalyzer::Window( SwayMetrics *out ) const
+{
+  const size_t n = config_.window;
+  *out = SwayMetrics();
+  out->timestamp_us = last_us_;
+  out->samples = uint32_t( count_ );
+  out->bin_hz = config_.sample_rate / n;
+  if( count_ == 0 )
+  {
+    return;
+  }
+
+  size_t newest = ( next_ + n - 1 ) % n;
+  out->cop_x = xs_[newest] + origin_x_;
+  out->cop_y = ys_[newest] + origin_y_;
+
+  // The oldest sample's step led into the window from outside it
+  out->path_length = sum_steps_ - ( count_ == n ? steps_[next_] : 0 );
+  double seconds = ( count_ - 1 ) / config_.sample_rate;
+  out->mean_velocity = seconds > 0 ? out->path_length / seconds : 0;
+
+  Spread( count_, sum_x_, sum_y_, sum_xx_, sum_yy_, sum_xy_, &out->rms_x,
+          &out->rms_y, &out->ellipse_area );
+  out->rms = hypot( out->rms_x, out->rms_y );
+
+  if( count_ == n )
+  {
+    for( size_t bin=0; bin < SWAY_BINS; ++bin )
+    {
+      out->spectrum_x[bin] = 2 * abs( dft_x_[bin] ) / n;
+      out->spectrum_y[bin] = 2 * abs( dft_y_[bin] ) / n;
+    }
+    out->mean_frequency = MeanFrequency();
+  }
+}
+
+void SwayAnalyzer::End( uint64_t timestamp_us, SwaySession *out )
+{
+  session_.end_us = timestamp_us;
+  if( session_.samples > 0 )
+  {
+    double rms_x, rms_y;
+    Spread( session_.samples, total_x_, total_y_, total_xx_, total_yy_,
+            total_xy_, &rms_x, &rms_y, &session_.ellipse_area );
+    session_.rms = hypot( rms_x, rms_y );
+    double seconds = ( session_.end_us - session_.start_us ) / 1e6;
+    session_.mean_velocity = seconds > 0 ? session_.path_length / seconds : 0;
+  }
+  session_.mean_frequency = frequency_windows_ > 0 ?
+    frequency_sum_ / frequency_windows_ : 0;
+  *out = session_;
+  active_ = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// SwaySessionLog
+
+SwaySessionLog::SwaySessionLog( sqlite::database &db, ThreadPool &pool )
+  : pool_( pool )
+{
+  db << "CREATE TABLE IF NOT EXISTS sway_sessions( "
+    "id INTEGER PRIMARY KEY,"
+    "device INTEGER NOT NULL,"
+    "user_id INTEGER NOT NULL DEFAULT 0,"
+    "start_us INTEGER NOT NULL,"
+    "end_us INTEGER NOT NULL,"
+    "samples INTEGER,"
+    "weight DOUBLE,"
+    "path_length DOUBLE,"
+    "mean_velocity DOUBLE,"
+    "rms DOUBLE,"
+    "ellipse_area DOUBLE,"
+    "mean_frequency DOUBLE );";
+  db << "CREATE INDEX IF NOT EXISTS sway_sessions_start "
+    "ON sway_sessions( start_us );";
+}
+
+void SwaySessionLog::Add( const SwaySession &session )
+{
+  // A failed INSERT is logged by the pool
+  pool_.Submit( [session]( sqlite::database &db ) {
+      const SwaySession &s = session;
+      db << "INSERT INTO sway_sessions (device, user_id, start_us, end_us, "
+        "samples, weight, path_length, mean_velocity, rms, ellipse_area, "
+        "mean_frequency) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);"
+        << int( s.device ) << sqlite_int64( s.user_id )
+        << sqlite_int64( s.start_us ) << sqlite_int64( s.end_us )
+        << sqlite_int64( s.samples ) << s.weight << s.path_length
+        << s.mean_velocity << s.rms << s.ellipse_area << s.mean_frequency;
+    }, []() {} );
+}
+
+vector<SwaySession> QuerySwaySessions( sqlite::database &db, int64_t user_id,
+                                       uint64_t start_us, uint64_t end_us,
+                                       size_t limit )
+{
+  vector<SwaySession> sessions;
+  db << "SELECT id, device, user_id, start_us, end_us, samples, weight, "
+    "path_length, mean_velocity, rms, ellipse_area, mean_frequency "
+    "FROM sway_sessions WHERE start_us BETWEEN ? AND ? "
+    "AND ( ? < 0 OR user_id = ? ) ORDER BY start_us DESC LIMIT ?;"
+    << sqlite_int64( start_us ) << sqlite_int64( end_us )
+    << sqlite_int64( user_id ) << sqlite_int64( user_id )
+    << sqlite_int64( limit )
+    >> [&sessions]( sqlite_int64 id, int device, sqlite_int64 user,
+                    sqlite_int64 start, sqlite_int64 end,
+                    sqlite_int64 samples, double weight, double path_length,
+                    double mean_velocity, double rms, double ellipse_area,
+                    double mean_frequency ) {
+      SwaySession s;
+      s.id = id;
+      s.device = uint32_t( device );
+      s.user_id = user;
+      s.start_us = uint64_t( start );
+      s.end_us = uint64_t( end );
+      s.samples = uint64_t( samples );
+      s.weight = weight;
+      s.path_length = path_length;
+      s.mean_velocity = mean_velocity;
+      s.rms = rms;
+      s.ellipse_area = ellipse_area;
+      s.mean_frequency = mean_frequency;
+      sessions.push_back( s );
+    };
+  return sessions;
+}
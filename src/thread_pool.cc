@@ -0,0 +1,109 @@
+#include "logging.h"
+#include "measurement_store.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool( event_base *base, int threads, const string &database )
+  : database_( database ), completed_{ nullptr }, running_{ 0 },
+    should_stop_{ false }
+{
+  completed_ = event_new( base, -1, 0, CompletedCallback, this );
+  for( int idx=0; idx < max( threads, 1 ); ++idx )
+  {
+    threads_.emplace_back( &ThreadPool::Run, this );
+  }
+  INFO( "Thread pool using {} workers", threads_.size() );
+}
+
+ThreadPool::~ThreadPool ()
+{
+  {
+    lock_guard<mutex> lock( mutex_ );
+    should_stop_ = true;
+  }
+  ready_.notify_all();
+  for( auto &thread : threads_ )
+  {
+    thread.join();
+  }
+  // Completions still queued are dropped, the loop is gone
+  event_free( completed_ );
+}
+
+void ThreadPool::Submit( Work work, Done done )
+{
+  {
+    lock_guard<mutex> lock( mutex_ );
+    tasks_.push_back( Task{ move( work ), move( done ) } );
+  }
+  ready_.notify_one();
+}
+
+size_t ThreadPool::Pending () const
+{
+  lock_guard<mutex> lock( mutex_ );
+  return tasks_.size() + running_;
+}
+
+void ThreadPool::Run ()
+{
+  auto db = OpenTunedDatabase( database_ );
+  while( true )
+  {
+    Task task;
+    {
+      unique_lock<mutex> lock( mutex_ );
+      ready_.wait( lock, [this]() { return should_stop_ || !tasks_.empty(); } );
+      if( should_stop_ )
+      {
+        break;
+      }
+      task = move( tasks_.front() );
+      tasks_.pop_front();
+      ++running_;
+    }
+
+    try
+    {
+      task.work( db );
+    }
+    catch( const exception &e )
+    {
+      ERROR( "Pool task failed: {}", e.what() );
+    }
+
+    bool wake;
+    {
+      lock_guard<mutex> lock( mutex_ );
+      --running_;
+      wake = completions_.empty();
+      completions_.push_back( move( task.done ));
+    }
+    // One activation drains every completion queued before it runs
+    if( wake )
+    {
+      event_active( completed_, EV_TIMEOUT, 0 );
+    }
+  }
+}
+
+void ThreadPool::CompletedCallback( evutil_socket_t fd, short what, void *arg )
+{
+  (void) fd;
+  (void) what;
+  auto pool = static_cast<ThreadPool*>( arg );
+
+  deque<Done> completions;
+  {
+    lock_guard<mutex> lock( pool->mutex_ );
+    completions.swap( pool->completions_ );
+  }
+  for( auto &done : completions )
+  {
+    if( done )
+    {
+      done();
+    }
+  }
+}
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "logging.h"
+#include "user_registry.h"
+
+using namespace std;
+
+static constexpr double US_PER_DAY = 86400e6;
+
+UserRegistry::UserRegistry( sqlite::database &db, const Options &options )
+  : options_( options ), db_( db )
+{
+  db_ << "CREATE TABLE IF NOT EXISTS users( "
+    "id INTEGER PRIMARY KEY,"
+    "name TEXT NOT NULL,"
+    "age INTEGER,"
+    "weight DOUBLE );";
+  Load();
+}
+
+UserRegistry::UserRegistry( sqlite::database &db )
+  : UserRegistry( db, Options() )
+{
+}
+
+void UserRegistry::Load ()
+{
+  db_ << "SELECT id, name, age, weight FROM users;"
+    >> [this]( sqlite_int64 id, string name, int age, double weight ) {
+      Entry &entry = users_[id];
+      entry.user = User{ id, name, age, weight };
+      entry.level = weight;
+      entry.slope = 0;
+      entry.last_us = 0;
+      entry.indexed = by_level_.end();
+    };
+
+  // Replay each user's latest weighings, oldest first, to seed the trends
+  auto recent = db_ << "SELECT timestamp_us, weight FROM measurements "
+    "WHERE user_id = ? ORDER BY timestamp_us DESC LIMIT ?;";
+  recent.used( true );
+  vector<pair<uint64_t, double>> weighings;
+  for( auto &user : users_ )
+  {
+    weighings.clear();
+    recent << sqlite_int64( user.first ) << int( options_.seed_history );
+    recent >> [&weighings]( sqlite_int64 timestamp_us, double weight ) {
+      weighings.emplace_back( uint64_t( timestamp_us ), weight );
+    };
+    for( auto it = weighings.rbegin(); it != weighings.rend(); ++it )
+    {
+      Observe( &user.second, it->first, it->second );
+    }
+    Reindex( &user.second );
+  }
+
+  INFO( "Loaded {} users", users_.size() );
+}
+
+int64_t UserRegistry::Add( const string &name, int age, double weight )
+{
+  db_ << "INSERT INTO users (name, age, weight) VALUES (?, ?, ?);"
+    << name << age << weight;
+  int64_t id = db_.last_insert_rowid();
+
+  Entry &entry = users_[id];
+  entry.user = User{ id, name, age, weight };
+  entry.level = weight;
+  entry.slope = 0;
+  entry.last_us = 0;
+  entry.indexed = by_level_.end();
+  Reindex( &entry );
+  INFO( "Added user {} '{}'", id, name );
+  return id;
+}
+
+bool UserRegistry::Update( const User &user )
+{
+  auto found = users_.find( user.id );
+  if( found == users_.end() )
+  {
+    return false;
+  }
+
+  db_ << "UPDATE users SET name = ?, age = ?, weight = ? WHERE id = ?;"
+    << user.name << user.age << user.weight << sqlite_int64( user.id );
+
+  Entry &entry = found->second;
+  if( user.weight != entry.user.weight )
+  {
+    entry.level = user.weight;
+    entry.slope = 0;
+    entry.last_us = 0;
+    Reindex( &entry );
+  }
+  entry.user = user;
+  return true;
+}
+
+bool UserRegistry::Remove( int64_t id )
+{
+  auto found = users_.find( id );
+  if( found == users_.end() )
+  {
+    return false;
+  }
+
+  // Their measurements stay, attributed to an id nobody has any more
+  db_ << "DELETE FROM users WHERE id = ?;" << sqlite_int64( id );
+  by_level_.erase( found->second.indexed );
+  users_.erase( found );
+  INFO( "Removed user {}", id );
+  return true;
+}
+
+const User* UserRegistry::Find( int64_t id ) const
+{
+  auto found = users_.find( id );
+  return found == users_.end() ? nullptr : &found->second.user;
+}
+
+vector<User> UserRegistry::All () const
+{
+  vector<User> users;
+  users.reserve( users_.size() );
+  for( const auto &user : users_ )
+  {
+    users.push_back( user.second.user );
+  }
+  sort( users.begin(), users.end(), []( const User &a, const User &b ) {
+      return a.id < b.id;
+    });
+  return users;
+}
+
+double UserRegistry::Expected( int64_t id, uint64_t timestamp_us ) const
+{
+  auto found = users_.find( id );
+  if( found == users_.end() )
+  {
+    return numeric_limits<double>::quiet_NaN();
+  }
+  return Predict( found->second, timestamp_us );
+}
+
+double UserRegistry::Predict( const Entry &entry, uint64_t timestamp_us ) const
+{
+  if( entry.last_us == 0 || timestamp_us <= entry.last_us )
+  {
+    return entry.level;
+  }
+  double days = min( ( timestamp_us - entry.last_us ) / US_PER_DAY,
+                     options_.max_trend_days );
+  return entry.level + entry.slope * days;
+}
+
+void UserRegistry::Observe( Entry *entry, uint64_t timestamp_us,
+                            double weight )
+{
+  if( entry->last_us == 0 )
+  {
+    // First weighing replaces the reference weight outright
+    entry->level = weight;
+    entry->last_us = timestamp_us;
+    return;
+  }
+
+  double predicted = Predict( *entry, timestamp_us );
+  double level = options_.level_gain * weight +
+    ( 1 - options_.level_gain ) * predicted;
+  double days = timestamp_us > entry->last_us ?
+    ( timestamp_us - entry->last_us ) / US_PER_DAY : 0;
+  // Weighings minutes apart say nothing about the slope
+  if( days > 0.01 )
+  {
+    double slope = options_.slope_gain * ( level - entry->level ) / days +
+      ( 1 - options_.slope_gain ) * entry->slope;
+    entry->slope = max( -options_.max_slope, min( slope, options_.max_slope ));
+  }
+  entry->level = level;
+  entry->last_us = max( entry->last_us, timestamp_us );
+}
+
+void UserRegistry::Reindex( Entry *entry )
+{
+  if( entry->indexed != by_level_.end() )
+  {
+    by_level_.erase( entry->indexed );
+  }
+  entry->indexed = by_level_.emplace( entry->level, entry->user.id );
+}
+
+int64_t UserRegistry::Attribute( uint64_t timestamp_us, double weight )
+{
+  // Only trends near the weight can match.  The window is widened by the
+  // most a trend can have drifted from its indexed level.
+  double window = options_.tolerance +
+    options_.max_slope * options_.max_trend_days;
+
+  Entry *best = nullptr;
+  double best_distance = options_.tolerance;
+  auto end = by_level_.upper_bound( weight + window );
+  for( auto it = by_level_.lower_bound( weight - window ); it != end; ++it )
+  {
+    Entry &entry = users_.at( it->second );
+    double distance = fabs( Predict( entry, timestamp_us ) - weight );
+    if( distance <= best_distance )
+    {
+      best = &entry;
+      best_distance = distance;
+    }
+  }
+
+  if( !best )
+  {
+    DEBUG( "No user within {} lbs of {:.1f}", options_.tolerance, weight );
+    return 0;
+  }
+
+  Observe( best, timestamp_us, weight );
+  Reindex( best );
+  return best->user.id;
+}
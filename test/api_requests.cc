@@ -0,0 +1,130 @@
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+
+#include <argh.h>
+
+#include "bench.h"
+#include "logging.h"
+#include "process.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// Requests missing fields their handler needs.  Each must get an "error"
+// reply, not take the server down.
+static const char *INCOMPLETE_REQUESTS[] = {
+  R"({"request": "get_history"})",
+  R"({"request": "get_history", "user_id": 1, "start_us": 0})",
+  R"({"request": "update_user"})",
+  R"({"request": "delete_user"})",
+  R"({"request": "add_calibration"})",
+  R"({"request": "add_calibration", "scale": 150})",
+  R"({"request": "add_calibration", "scale": 150, "corners": [40, 40]})",
+  R"({})",
+};
+
+// The reply to message, or null if there was none.
+static json Call( ApiClient &client, string message )
+{
+  message.push_back( '\0' );
+  string reply;
+  if( !client.Request( message, &reply ))
+  {
+    return nullptr;
+  }
+  // Replies are C strings
+  return json::parse( reply.c_str() );
+}
+
+// The "response" of a reply, or empty if there was none.
+static string Send( ApiClient &client, const string &message )
+{
+  json reply = Call( client, message );
+  return reply.is_object() ? reply.value( "response", "" ) : "";
+}
+
+static int RunTests( const BenchOptions &options )
+{
+  WiightProcess wiight( options, { "--simulate=1", "--sync_log" } );
+  wiight.WaitForMetrics();
+  ApiClient client( options.api_port, 5000 );
+
+  int failures = 0;
+  for( const char *request : INCOMPLETE_REQUESTS )
+  {
+    string response = Send( client, request );
+    wiight.CheckRunning();
+    if( response != "error" )
+    {
+      fprintf( stderr, "FAIL %s: response '%s', expected 'error'\n", request,
+               response.c_str() );
+      ++failures;
+    }
+  }
+
+  // The simulated board, device 1, has no calibration points of its own, so
+  // recalibrating the shared profile has to rewrite its rows too
+  json reply = Call( client, R"({"request": "recalibrate_history"})" );
+  wiight.CheckRunning();
+  json expected = { 0, 1 };
+  if( !reply.is_object() || reply.value( "response", "" ) != "recalibrated" ||
+      reply.value( "devices", json() ) != expected )
+  {
+    fprintf( stderr, "FAIL recalibrate_history of the shared profile: %s\n",
+             reply.dump().c_str() );
+    ++failures;
+  }
+
+  string response = Send( client, R"({"request": "get_status"})" );
+  wiight.CheckRunning();
+  if( response != "status" )
+  {
+    fprintf( stderr, "FAIL get_status after the bad requests: '%s'\n",
+             response.c_str() );
+    ++failures;
+  }
+  return failures;
+}
+
+// wiight_api_test [--wiight=<binary>] [--work_dir=<dir>] [--http_port=<n>]
+//                 [--api_port=<n>]
+//
+// Starts wiight with a simulated board and sends it every API request with
+// its required fields left out.  Exits non-zero if any of them didn't get an
+// error reply or the process died.
+int main( int argc, char **argv )
+{
+  argh::parser cmdl( argc, argv );
+
+  BenchOptions options;
+  cmdl( "wiight", WIIGHT_BINARY ) >> options.wiight;
+  cmdl( "work_dir", options.work_dir ) >> options.work_dir;
+  // Clear of the ports wiight_bench and wiight_load default to
+  cmdl( "http_port", 18180 ) >> options.http_port;
+  cmdl( "api_port", 18181 ) >> options.api_port;
+
+  setenv( "LOGLEVEL", "error", 0 );
+  LogOptions log_options;
+  log_options.async = false;
+  StartLogging( log_options );
+
+  int failures;
+  try
+  {
+    failures = RunTests( options );
+  }
+  catch( const exception &e )
+  {
+    fprintf( stderr, "FAIL %s\n", e.what() );
+    return 1;
+  }
+  if( failures > 0 )
+  {
+    fprintf( stderr, "%d API request tests failed\n", failures );
+    return 1;
+  }
+  printf( "All API request tests passed\n" );
+  return 0;
+}
@@ -40,6 +40,46 @@ var send_request = function( ws, obj )
   console.log("sent message");
 }
 
+var FRAME_DOUBLES = 8;
+var FRAME_BYTES = FRAME_DOUBLES * 8;
+
+// Streams /stream?format=binary and calls on_frame with a Float64Array view
+// of each frame.  Network chunks don't respect frame boundaries, so a partial
+// frame is carried over to the next chunk.
+var read_live_frames = function( rate, on_frame )
+{
+  fetch( '/stream?format=binary&rate=' + rate ).then( function( response ) {
+    var reader = response.body.getReader();
+    var carry = new Uint8Array( 0 );
+    var pump = function() {
+      return reader.read().then( function( result ) {
+        if( result.done )
+        {
+          return;
+        }
+        var bytes = result.value;
+        if( carry.length > 0 || bytes.byteOffset % 8 != 0 )
+        {
+          var joined = new Uint8Array( carry.length + bytes.length );
+          joined.set( carry );
+          joined.set( bytes, carry.length );
+          bytes = joined;
+        }
+        var whole = bytes.length - bytes.length % FRAME_BYTES;
+        var doubles = new Float64Array( bytes.buffer, bytes.byteOffset,
+                                        whole / 8 );
+        for( var i=0; i < doubles.length; i += FRAME_DOUBLES )
+        {
+          on_frame( doubles.subarray( i, i + FRAME_DOUBLES ));
+        }
+        carry = bytes.slice( whole );
+        return pump();
+      });
+    };
+    return pump();
+  });
+}
+
 $(document).ready( function() {
 
   var button = $("#input_button");
@@ -83,6 +123,29 @@ $(document).ready( function() {
   ws.onerror = function( e ) { result.text( "WS error" ); }
   ws.onopen = function( e ) { result.text( "WS opened" ); }
   
+  // Live samples and settle events as packed frames of eight doubles:
+  // kind (0 sample, 1 step_on, 2 settled, 3 step_off), time, weight, cop_x,
+  // cop_y, stddev, confidence, device.  Sway frames (kind 4) carry path
+  // length, RMS, ellipse area, mean velocity and mean frequency instead.
+  read_live_frames( 10, function( f ) {
+    if( f[0] == 0 )
+    {
+      $('#live_weight').text( 'board ' + f[7] + ': ' + f[2].toFixed( 1 ));
+    }
+    else if( f[0] == 4 )
+    {
+      $('#live_sway').text( 'board ' + f[7] + ' sway: rms ' +
+                            f[3].toFixed( 1 ) + ' mm, ' + f[5].toFixed( 1 ) +
+                            ' mm/s, ellipse ' + f[4].toFixed( 0 ) + ' mm^2' );
+    }
+    else
+    {
+      var names = [ 'step_on', 'settled', 'step_off' ];
+      $('#live_event').text( 'board ' + f[7] + ': ' + names[f[0]-1] + ' ' +
+                             f[2].toFixed( 1 ));
+    }
+  });
+
   button.click( function() {
     var data = { 
       'request' : 'get_users'